@@ -0,0 +1,20 @@
+#!/bin/bash
+# usage: bench/run.sh binary...
+# times every bench/*.lox once with each binary
+bins=()
+for bin in "$@"; do
+  bins+=("$(cd "$(dirname "$bin")" && pwd)/$(basename "$bin")")
+done
+cd "$(dirname "$0")"
+TIMEFORMAT=%R
+printf "%-12s" "benchmark"
+for bin in "${bins[@]}"; do printf "%12s" "$(basename "$bin" .out)"; done
+printf "\n"
+for script in *.lox; do
+  printf "%-12s" "${script%.lox}"
+  for bin in "${bins[@]}"; do
+    t=$( { time "$bin" "$script" > /dev/null 2>&1; } 2>&1 )
+    printf "%12s" "${t}s"
+  done
+  printf "\n"
+done
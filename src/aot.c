@@ -0,0 +1,443 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+
+static int short_operand(uint8_t *ip) {
+    return (ip[1] << 8) | ip[2];
+}
+
+static int long_operand(uint8_t *ip) {
+    return (ip[1] << 16) | (ip[2] << 8) | ip[3];
+}
+
+/* bytes of the instruction at offset, 0 for an op the compiler never emits */
+static int instruction_length(Chunk *chunk, int offset) {
+    switch(chunk->code[offset]) {
+        case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_POP:
+        case OP_EQUAL: case OP_GREATER: case OP_LESS:
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+        case OP_NOT: case OP_NEGATE: case OP_PRINT:
+        case OP_CLOSE_UPVALUE: case OP_RETURN:
+        case OP_ADD_NUM: case OP_ADD_STR: case OP_GREATER_NUM: case OP_LESS_NUM:
+            return 1;
+        case OP_CONSTANT: case OP_GET_LOCAL: case OP_SET_LOCAL:
+        case OP_GET_UPVALUE: case OP_SET_UPVALUE:
+        case OP_CALL: case OP_TAIL_CALL: case OP_SET_LOCAL_POP:
+            return 2;
+        case OP_GET_GLOBAL: case OP_SET_GLOBAL: case OP_DEF_GLOBAL:
+        case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_LOOP: case OP_LOOP_TRACE:
+        case OP_ADD_LOCALS: case OP_ADD_LOCAL_CONST: case OP_LESS_LOCAL_CONST:
+        case OP_GET_LOCAL_LONG: case OP_SET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG: case OP_SET_UPVALUE_LONG:
+            return 3;
+        case OP_CONSTANT_LONG:
+            return 4;
+        case OP_CLOSURE: {
+            obj_function *function =
+                AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->up_count;
+        }
+        case OP_CLOSURE_LONG: {
+            obj_function *function =
+                AS_FUNCTION(chunk->constants.values[long_operand(chunk->code + offset)]);
+            return 4 + 3 * function->up_count;
+        }
+        default:
+            return 0;
+    }
+}
+
+/* a C string literal, octal escapes can't swallow the chars after them */
+static void emit_string(FILE *out, const char *chars, int length) {
+    fputc('"', out);
+    for(int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)chars[i];
+        if(c >= 0x20 && c < 0x7f && c != '"' && c != '\\' && c != '?')
+            fputc(c, out);
+        else
+            fprintf(out, "\\%03o", c);
+    }
+    fputc('"', out);
+}
+
+static void emit_double(FILE *out, double number) {
+    if(isnan(number))
+        fputs("__builtin_nan(\"\")", out);
+    else if(isinf(number))
+        fputs(number < 0 ? "-__builtin_inf()" : "__builtin_inf()", out);
+    else
+        fprintf(out, "%a", number);
+}
+
+/* what the first pass over a chunk finds out */
+typedef struct {
+    /* offsets run() may come back in at */
+    bool *entries;
+    /* offsets some jump lands on, entries included */
+    bool *labels;
+    bool uses_slots;
+    bool uses_constants;
+} chunk_info;
+
+static bool scan_chunk(Chunk *chunk, chunk_info *info) {
+    info->entries = calloc(chunk->count + 1, sizeof(bool));
+    info->labels = calloc(chunk->count + 1, sizeof(bool));
+    if(info->entries == NULL || info->labels == NULL)
+        return false;
+    info->entries[0] = info->labels[0] = true;
+    info->uses_slots = false;
+    info->uses_constants = false;
+
+    for(int offset = 0; offset < chunk->count;) {
+        uint8_t *ip = chunk->code + offset;
+        int length = instruction_length(chunk, offset);
+        if(length == 0)
+            return false;
+        switch(*ip) {
+            case OP_CALL: case OP_TAIL_CALL:
+                info->entries[offset + length] = true;
+                info->labels[offset + length] = true;
+                break;
+            case OP_JUMP: case OP_JUMP_IF_FALSE:
+                info->labels[offset + 3 + short_operand(ip)] = true;
+                break;
+            case OP_LOOP: case OP_LOOP_TRACE:
+                info->labels[offset + 3 - short_operand(ip)] = true;
+                break;
+            case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_SET_LOCAL_POP:
+            case OP_ADD_LOCALS: case OP_GET_LOCAL_LONG: case OP_SET_LOCAL_LONG:
+                info->uses_slots = true;
+                break;
+            case OP_CONSTANT: case OP_CONSTANT_LONG:
+                info->uses_constants = true;
+                break;
+            case OP_ADD_LOCAL_CONST: case OP_LESS_LOCAL_CONST:
+                info->uses_slots = true;
+                info->uses_constants = true;
+                break;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+/* one statement of C for the instruction at offset */
+static void emit_instruction(FILE *out, Chunk *chunk, int offset) {
+    uint8_t *ip = chunk->code + offset;
+    switch(*ip) {
+        case OP_CONSTANT: fprintf(out, "*sp++ = constants[%d];\n", ip[1]); break;
+        case OP_CONSTANT_LONG:
+            fprintf(out, "*sp++ = constants[%d];\n", long_operand(ip));
+            break;
+        case OP_NIL:      fputs("*sp++ = NIL_VAL;\n", out); break;
+        case OP_TRUE:     fputs("*sp++ = BOOL_VAL(true);\n", out); break;
+        case OP_FALSE:    fputs("*sp++ = BOOL_VAL(false);\n", out); break;
+        case OP_POP:      fputs("sp--;\n", out); break;
+        case OP_GET_LOCAL:
+            fprintf(out, "*sp++ = slots[%d];\n", ip[1]);
+            break;
+        case OP_SET_LOCAL:
+            fprintf(out, "slots[%d] = sp[-1];\n", ip[1]);
+            break;
+        case OP_SET_LOCAL_POP:
+            fprintf(out, "slots[%d] = *--sp;\n", ip[1]);
+            break;
+        case OP_GET_LOCAL_LONG:
+            fprintf(out, "*sp++ = slots[%d];\n", short_operand(ip));
+            break;
+        case OP_SET_LOCAL_LONG:
+            fprintf(out, "slots[%d] = sp[-1];\n", short_operand(ip));
+            break;
+        case OP_GET_GLOBAL:
+            fprintf(out, "AOT_GET_GLOBAL(%d, %d);\n", offset, short_operand(ip));
+            break;
+        case OP_SET_GLOBAL:
+            fprintf(out, "AOT_SET_GLOBAL(%d, %d);\n", offset, short_operand(ip));
+            break;
+        case OP_GET_UPVALUE:
+            fprintf(out, "*sp++ = *frame->closure->upvalues[%d]->location;\n", ip[1]);
+            break;
+        case OP_GET_UPVALUE_LONG:
+            fprintf(out, "*sp++ = *frame->closure->upvalues[%d]->location;\n",
+                    short_operand(ip));
+            break;
+        case OP_JUMP:
+            fprintf(out, "goto at_%d;\n", offset + 3 + short_operand(ip));
+            break;
+        case OP_LOOP: case OP_LOOP_TRACE:
+            fprintf(out, "goto at_%d;\n", offset + 3 - short_operand(ip));
+            break;
+        case OP_JUMP_IF_FALSE:
+            fprintf(out, "if(AOT_FALSEY(sp[-1])) goto at_%d;\n",
+                    offset + 3 + short_operand(ip));
+            break;
+        case OP_ADD: case OP_ADD_NUM: case OP_ADD_STR:
+            fprintf(out, "AOT_ARITH(%d, OP_ADD, __builtin_add_overflow, +, 0);\n", offset);
+            break;
+        case OP_SUBTRACT:
+            fprintf(out, "AOT_ARITH(%d, OP_SUBTRACT, __builtin_sub_overflow, -, 0);\n", offset);
+            break;
+        case OP_MULTIPLY:
+            fprintf(out, "AOT_ARITH(%d, OP_MULTIPLY, __builtin_mul_overflow, *, 0);\n", offset);
+            break;
+        case OP_DIVIDE:
+            fprintf(out, "AOT_DIVIDE(%d);\n", offset);
+            break;
+        case OP_LESS: case OP_LESS_NUM:
+            fprintf(out, "AOT_COMPARE(%d, OP_LESS, <, 0);\n", offset);
+            break;
+        case OP_GREATER: case OP_GREATER_NUM:
+            fprintf(out, "AOT_COMPARE(%d, OP_GREATER, >, 0);\n", offset);
+            break;
+        case OP_EQUAL:
+            fprintf(out, "AOT_EQUAL(%d);\n", offset);
+            break;
+        case OP_NOT:
+            fputs("sp[-1] = BOOL_VAL(AOT_FALSEY(sp[-1]));\n", out);
+            break;
+        case OP_NEGATE:
+            fprintf(out, "AOT_NEGATE(%d);\n", offset);
+            break;
+        case OP_ADD_LOCALS:
+            fprintf(out, "*sp++ = slots[%d]; *sp++ = slots[%d]; "
+                    "AOT_ARITH(%d, OP_ADD, __builtin_add_overflow, +, 2);\n",
+                    ip[1], ip[2], offset);
+            break;
+        case OP_ADD_LOCAL_CONST:
+            fprintf(out, "*sp++ = slots[%d]; *sp++ = constants[%d]; "
+                    "AOT_ARITH(%d, OP_ADD, __builtin_add_overflow, +, 2);\n",
+                    ip[1], ip[2], offset);
+            break;
+        case OP_LESS_LOCAL_CONST:
+            fprintf(out, "*sp++ = slots[%d]; *sp++ = constants[%d]; "
+                    "AOT_COMPARE(%d, OP_LESS, <, 2);\n",
+                    ip[1], ip[2], offset);
+            break;
+        case OP_PRINT:
+            fprintf(out, "AOT_SLOW(%d, OP_PRINT, 0);\n", offset);
+            break;
+        case OP_DEF_GLOBAL:
+            fprintf(out, "AOT_SLOW(%d, OP_DEF_GLOBAL, 0);\n", offset);
+            break;
+        case OP_SET_UPVALUE:
+            fprintf(out, "AOT_SLOW(%d, OP_SET_UPVALUE, 0);\n", offset);
+            break;
+        case OP_SET_UPVALUE_LONG:
+            fprintf(out, "AOT_SLOW(%d, OP_SET_UPVALUE_LONG, 0);\n", offset);
+            break;
+        case OP_CLOSE_UPVALUE:
+            fprintf(out, "AOT_SLOW(%d, OP_CLOSE_UPVALUE, 0);\n", offset);
+            break;
+        case OP_CLOSURE:
+            fprintf(out, "AOT_SLOW(%d, OP_CLOSURE, 0);\n", offset);
+            break;
+        case OP_CLOSURE_LONG:
+            fprintf(out, "AOT_SLOW(%d, OP_CLOSURE_LONG, 0);\n", offset);
+            break;
+        default:
+            /* calls, tail calls and returns belong to run() */
+            fprintf(out, "AOT_LEAVE(%d, 0);\n", offset);
+            break;
+    }
+}
+
+static void emit_run(FILE *out, Chunk *chunk, int id, chunk_info *info) {
+    fprintf(out, "static Val *run_%d(call_frame *frame, Val *sp) {\n", id);
+    fputs("    uint8_t *code = frame->closure->function->chunk.code;\n", out);
+    if(info->uses_slots)
+        fputs("    Val *slots = frame->slots;\n", out);
+    if(info->uses_constants)
+        fputs("    Val *constants = frame->closure->function->chunk.constants.values;\n", out);
+    fputs("    switch(frame->ip - code) {\n", out);
+    for(int offset = 0; offset < chunk->count; offset++)
+        if(info->entries[offset])
+            fprintf(out, "        case %d: goto at_%d;\n", offset, offset);
+    fputs("    }\n", out);
+    /* anywhere else run() goes on interpreting */
+    fputs("    return sp;\n", out);
+
+    for(int offset = 0; offset < chunk->count;) {
+        if(info->labels[offset])
+            fprintf(out, "at_%d:\n", offset);
+        fputs("    ", out);
+        emit_instruction(out, chunk, offset);
+        offset += instruction_length(chunk, offset);
+    }
+    fputs("}\n\n", out);
+}
+
+/* nested functions are written before the functions holding them.
+ * returns the id of function, -1 if it can't be written */
+static int emit_function(FILE *out, obj_function *function, int *next_id) {
+    Chunk *chunk = &function->chunk;
+    val_array *constants = &chunk->constants;
+    int *nested = calloc(constants->count + 1, sizeof(int));
+    if(nested == NULL)
+        return -1;
+    for(int i = 0; i < constants->count; i++) {
+        if(!IS_FUNCTION(constants->values[i]))
+            continue;
+        nested[i] = emit_function(out, AS_FUNCTION(constants->values[i]), next_id);
+        if(nested[i] < 0) {
+            free(nested);
+            return -1;
+        }
+    }
+
+    chunk_info info;
+    if(!scan_chunk(chunk, &info)) {
+        free(info.entries);
+        free(info.labels);
+        free(nested);
+        return -1;
+    }
+
+    int id = (*next_id)++;
+    fprintf(out, "/* %s */\n", function->name != NULL ? function->name->chars : "script");
+    fprintf(out, "static const uint8_t code_%d[] = {", id);
+    for(int i = 0; i < chunk->count; i++)
+        fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : " ", chunk->code[i]);
+    fprintf(out, "\n};\nstatic const int lines_%d[] = {", id);
+    for(int i = 0; i < chunk->count; i++)
+        fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : " ", chunk->lines[i]);
+    fputs("\n};\n", out);
+
+    bool failed = false;
+    if(constants->count > 0) {
+        fprintf(out, "static const aot_constant constants_%d[] = {\n", id);
+        for(int i = 0; i < constants->count && !failed; i++) {
+            Val value = constants->values[i];
+            fputs("    {", out);
+            if(IS_INTEGER(value)) {
+                fprintf(out, "AOT_INT, .integer = %lldLL", (long long)as_integer(value));
+            } else if(IS_DOUBLE(value)) {
+                fputs("AOT_DOUBLE, .number = ", out);
+                emit_double(out, AS_DOUBLE(value));
+            } else if(IS_STRING(value)) {
+                obj_string *string = AS_STRING(value);
+                fputs("AOT_STRING, .chars = ", out);
+                emit_string(out, string->chars, string->length);
+                fprintf(out, ", .length = %d", string->length);
+            } else if(IS_FUNCTION(value)) {
+                fprintf(out, "AOT_FUNCTION, .function = &function_%d", nested[i]);
+            } else {
+                failed = true;
+            }
+            fputs("},\n", out);
+        }
+        fputs("};\n", out);
+    }
+    free(nested);
+    if(failed) {
+        free(info.entries);
+        free(info.labels);
+        return -1;
+    }
+
+    fprintf(out, "static Val *run_%d(call_frame *frame, Val *sp);\n", id);
+    fprintf(out, "static const aot_function function_%d = {\n    ", id);
+    if(function->name != NULL)
+        emit_string(out, function->name->chars, function->name->length);
+    else
+        fputs("NULL", out);
+    fprintf(out, ", %d, %d, %d, code_%d, lines_%d, %d,\n", function->arity,
+            function->up_count, function->max_stack, id, id, chunk->count);
+    if(constants->count > 0)
+        fprintf(out, "    constants_%d, %d, run_%d\n};\n\n", id, constants->count, id);
+    else
+        fprintf(out, "    NULL, 0, run_%d\n};\n\n", id);
+
+    emit_run(out, chunk, id, &info);
+    free(info.entries);
+    free(info.labels);
+    return id;
+}
+
+bool emit_c(obj_function *script, FILE *out) {
+    fputs("/* generated by cpplox --emit-c. build it against libcpplox.a made\n"
+          " * with the same flags as the cpplox that generated it */\n"
+          "#include \"aot.h\"\n\n", out);
+    int next_id = 0;
+    int id = emit_function(out, script, &next_id);
+    if(id < 0)
+        return false;
+
+    /* the natives and the script's globals, in the slots the code uses */
+    fputs("static const char *const globals[] = {\n", out);
+    for(int i = 0; i < vm.global_names.count; i++) {
+        obj_string *name = AS_STRING(vm.global_names.values[i]);
+        fputs("    ", out);
+        emit_string(out, name->chars, name->length);
+        fputs(",\n", out);
+    }
+    fputs("};\n\n", out);
+    fprintf(out, "int main(void) {\n"
+            "    return aot_main(&function_%d, globals, %d);\n"
+            "}\n", id, vm.global_names.count);
+    return true;
+}
+
+/* the function is left on the stack, where the collector sees it */
+static obj_function *load_function(const aot_function *desc) {
+    obj_function *function = new_function();
+    push(OBJ_VAL(function));
+    function->arity = desc->arity;
+    function->up_count = desc->up_count;
+    function->max_stack = desc->max_stack;
+    function->aot = desc->run;
+    if(desc->name != NULL)
+        STORE_REF(function, function->name,
+                copy_string(desc->name, (int)strlen(desc->name)));
+    for(int i = 0; i < desc->count; i++)
+        writeChunk(&function->chunk, desc->code[i], desc->lines[i]);
+
+    for(int i = 0; i < desc->constant_count; i++) {
+        const aot_constant *constant = &desc->constants[i];
+        Val value = NIL_VAL;
+        switch(constant->type) {
+            case AOT_INT:
+                value = integer_val(constant->integer);
+                break;
+            case AOT_DOUBLE:
+                value = NUMBER_VAL(constant->number);
+                break;
+            case AOT_STRING:
+                value = OBJ_VAL(copy_string(constant->chars, constant->length));
+                break;
+            case AOT_FUNCTION:
+                value = OBJ_VAL(load_function(constant->function));
+                break;
+        }
+        add_const(&function->chunk, value);
+        /* the function may have been promoted while loading the rest */
+        write_barrier((Obj*)function, value);
+        if(constant->type == AOT_FUNCTION)
+            pop();
+    }
+    return function;
+}
+
+int aot_main(const aot_function *script, const char *const *globals, int global_count) {
+    init_vm();
+    for(int i = 0; i < global_count; i++) {
+        if(global_slot(copy_string(globals[i], (int)strlen(globals[i]))) != i) {
+            fprintf(stderr, "global \"%s\" isn't where the compiled code expects it, "
+                    "rebuild the runtime with the same cpplox.\n", globals[i]);
+            free_vm();
+            return 70;
+        }
+    }
+
+    obj_function *function = load_function(script);
+    pop();
+    interpreted_result result = interpret_function(function);
+    free_vm();
+
+    if(result == INTERPRET_RUNTIME_ERROR) {
+        printf("RUNTIME ERROR\n");
+        return 70;
+    }
+    return 0;
+}
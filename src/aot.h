@@ -0,0 +1,160 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include "common.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+/* a script compiled ahead of time is a C file with one function per Lox
+ * function, each opcode lowered to the C below. the bytecode is kept
+ * alongside, the C works on the interpreter's own stack and frame like
+ * the jit's code does and hands calls, returns and failing ops back to
+ * run(), which comes back in after every call */
+
+typedef enum {
+    AOT_INT,
+    AOT_DOUBLE,
+    AOT_STRING,
+    AOT_FUNCTION
+} aot_constant_type;
+
+typedef struct aot_function aot_function;
+
+typedef struct {
+    uint8_t type;
+    int64_t integer;
+    double number;
+    const char *chars;
+    int length;
+    const aot_function *function;
+} aot_constant;
+
+/* everything the loader needs to rebuild an obj_function */
+struct aot_function {
+    const char *name;   // NULL for the script
+    int arity;
+    int up_count;
+    int max_stack;
+    const uint8_t *code;
+    const int *lines;
+    int count;
+    const aot_constant *constants;
+    int constant_count;
+    /* run the function from frame->ip, as jit_run() does */
+    Val *(*run)(struct call_frame *frame, Val *sp);
+};
+
+/* write script and every function nested in it as C, false if it uses
+ * a constant the loader can't rebuild */
+bool emit_c(obj_function *script, FILE *out);
+/* load script, binding globals to the slots they had when it was
+ * compiled, and run it. returns the exit code the interpreter would */
+int aot_main(const aot_function *script, const char *const *globals, int global_count);
+
+/* the generated code keeps code, slots and constants of its function
+ * in locals. at is the chunk offset of the op, pushed what a fused op
+ * pushed before the op it ends with, run() starts the op over */
+#define AOT_LEAVE(at, pushed)                                                 \
+    do {                                                                      \
+        frame->ip = code + (at);                                              \
+        return sp - (pushed);                                                 \
+    } while(false)
+
+#define AOT_SLOW(at, op, pushed)                                              \
+    do {                                                                      \
+        Val *top_ = jit_slow_path(sp, frame, code + (at), (op));              \
+        if(top_ == NULL)                                                      \
+            AOT_LEAVE(at, pushed);                                            \
+        sp = top_;                                                            \
+    } while(false)
+
+#define AOT_FALSEY(value) (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+#define AOT_GET_GLOBAL(at, slot)                                              \
+    do {                                                                      \
+        Val value_ = vm.global_values.values[slot];                           \
+        if(IS_UNDEFINED(value_))                                              \
+            AOT_LEAVE(at, 0);                                                 \
+        *sp++ = value_;                                                       \
+    } while(false)
+
+#define AOT_SET_GLOBAL(at, slot)                                              \
+    do {                                                                      \
+        if(IS_UNDEFINED(vm.global_values.values[slot]))                       \
+            AOT_LEAVE(at, 0);                                                 \
+        vm.global_values.values[slot] = sp[-1];                               \
+        root_write_barrier(sp[-1]);                                           \
+    } while(false)
+
+/* integers stay exact while the result fits, as in run(). wider
+ * results and boxed integers go to the slow path */
+#define AOT_ARITH(at, op, overflows, c_op, pushed)                            \
+    do {                                                                      \
+        Val a_ = sp[-2];                                                      \
+        Val b_ = sp[-1];                                                      \
+        int64_t result_;                                                      \
+        if(IS_INT(a_) && IS_INT(b_) &&                                        \
+           !overflows(AS_INT(a_), AS_INT(b_), &result_) &&                    \
+           result_ >= VAL_INT_MIN && result_ <= VAL_INT_MAX) {                \
+            sp[-2] = INT_VAL(result_);                                        \
+            sp--;                                                             \
+        } else if(IS_NUMBER(a_) && IS_NUMBER(b_) &&                           \
+                  (IS_DOUBLE(a_) || IS_DOUBLE(b_))) {                         \
+            sp[-2] = NUMBER_VAL(AS_NUMBER(a_) c_op AS_NUMBER(b_));            \
+            sp--;                                                             \
+        } else {                                                              \
+            AOT_SLOW(at, op, pushed);                                         \
+        }                                                                     \
+    } while(false)
+
+/* doubles divide here, integers in the slow path */
+#define AOT_DIVIDE(at)                                                        \
+    do {                                                                      \
+        if(IS_DOUBLE(sp[-2]) && IS_DOUBLE(sp[-1])) {                          \
+            sp[-2] = NUMBER_VAL(AS_DOUBLE(sp[-2]) / AS_DOUBLE(sp[-1]));       \
+            sp--;                                                             \
+        } else {                                                              \
+            AOT_SLOW(at, OP_DIVIDE, 0);                                       \
+        }                                                                     \
+    } while(false)
+
+#define AOT_COMPARE(at, op, c_op, pushed)                                     \
+    do {                                                                      \
+        Val a_ = sp[-2];                                                      \
+        Val b_ = sp[-1];                                                      \
+        if(IS_INT(a_) && IS_INT(b_)) {                                        \
+            sp[-2] = BOOL_VAL(AS_INT(a_) c_op AS_INT(b_));                    \
+            sp--;                                                             \
+        } else if(IS_NUMBER(a_) && IS_NUMBER(b_)) {                           \
+            sp[-2] = BOOL_VAL(AS_NUMBER(a_) c_op AS_NUMBER(b_));              \
+            sp--;                                                             \
+        } else {                                                              \
+            AOT_SLOW(at, op, pushed);                                         \
+        }                                                                     \
+    } while(false)
+
+/* strings may be ropes, the slow path flattens them first */
+#define AOT_EQUAL(at)                                                         \
+    do {                                                                      \
+        if(!IS_OBJ(sp[-2]) && !IS_OBJ(sp[-1])) {                              \
+            sp[-2] = BOOL_VAL(is_equal(sp[-2], sp[-1]));                      \
+            sp--;                                                             \
+        } else {                                                              \
+            AOT_SLOW(at, OP_EQUAL, 0);                                        \
+        }                                                                     \
+    } while(false)
+
+#define AOT_NEGATE(at)                                                        \
+    do {                                                                      \
+        Val value_ = sp[-1];                                                  \
+        if(IS_INT(value_) && AS_INT(value_) != VAL_INT_MIN)                   \
+            sp[-1] = INT_VAL(-AS_INT(value_));                                \
+        else if(IS_DOUBLE(value_))                                            \
+            sp[-1] = NUMBER_VAL(-AS_DOUBLE(value_));                          \
+        else                                                                  \
+            AOT_SLOW(at, OP_NEGATE, 0);                                       \
+    } while(false)
+
+#endif
@@ -1,6 +1,8 @@
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 #include <stdlib.h>
+#include <string.h>
 /* #include "value.h" */
 /* #include <stdio.h> */
 
@@ -11,22 +13,28 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     init_val_array(&chunk->constants); //Initialise constants along woth the chunk
+    chunk->const_index = NULL;
+    chunk->const_index_capacity = 0;
 }
 
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     free_val_array(&chunk->constants); //Free constants with the chunk
+    FREE_ARRAY(int, chunk->const_index, chunk->const_index_capacity);
     initChunk(chunk); //Why? -> Zero out all the fields of the chunk, to create a clean state
 }
 
 void writeChunk (Chunk* chunk, uint8_t byte, int line){ 
     if(chunk->capacity < chunk->count + 1) {   //count has exceeded capacity
         int oldCapacity = chunk->capacity;
-        chunk->capacity = GROW_CAPACITY(oldCapacity);
+        int capacity = GROW_CAPACITY(oldCapacity);
 
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        /* growing may fail and unwind, only commit to the new capacity
+         * once both arrays have it */
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, capacity);
+        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, capacity);
+        chunk->capacity = capacity;
     } // This case will be encountered the very first time when the initChunk() func creates a new raw chunk
     chunk->code[chunk->count] = byte;
     chunk->lines[chunk->count] = line;
@@ -34,9 +42,89 @@ void writeChunk (Chunk* chunk, uint8_t byte, int line){
 }
 
 int add_const(Chunk *chunk, Val value) {
+    /* growing the pool may collect, keep the value reachable meanwhile */
+    push(value);
     write_val_array(&chunk->constants, value);
+    pop();
     return chunk->constants.count - 1;
 
 }
 
+/* numbers and strings are looked up before they are added. strings are
+ * interned so their pointer is their identity. 1 and 1.0 are equal to
+ * programs but not the same constant */
+static bool is_indexed(Val value) {
+    return IS_INTEGER(value) || IS_DOUBLE(value) || IS_STRING(value);
+}
+
+static uint64_t double_bits(double number) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return bits;
+}
+
+static bool same_const(Val a, Val b) {
+    if(IS_INTEGER(a))
+        return IS_INTEGER(b) && as_integer(a) == as_integer(b);
+    if(IS_DOUBLE(a))
+        return IS_DOUBLE(b) && double_bits(AS_DOUBLE(a)) == double_bits(AS_DOUBLE(b));
+    return IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b);
+}
+
+static uint32_t const_hash(Val value) {
+    if(IS_STRING(value))
+        return AS_STRING(value)->hash;
+    uint64_t bits = IS_INTEGER(value) ? (uint64_t)as_integer(value) : double_bits(AS_DOUBLE(value));
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+/* the bucket of value, or the empty one it would go in */
+static int *find_bucket(int *buckets, int capacity, Val *constants, Val value) {
+    uint32_t mask = (uint32_t)capacity - 1;
+    for(uint32_t i = const_hash(value) & mask;; i = (i + 1) & mask) {
+        if(buckets[i] == 0 || same_const(constants[buckets[i] - 1], value))
+            return &buckets[i];
+    }
+}
+
+static void grow_index(Chunk *chunk) {
+    int capacity = GROW_CAPACITY(chunk->const_index_capacity);
+    int *buckets = GROW_ARRAY(int, NULL, 0, capacity);
+    memset(buckets, 0, capacity * sizeof(int));
+    for(int i = 0; i < chunk->constants.count; i++) {
+        Val constant = chunk->constants.values[i];
+        if(!is_indexed(constant)) continue;
+        int *bucket = find_bucket(buckets, capacity, chunk->constants.values, constant);
+        if(*bucket == 0) *bucket = i + 1;
+    }
+    FREE_ARRAY(int, chunk->const_index, chunk->const_index_capacity);
+    chunk->const_index = buckets;
+    chunk->const_index_capacity = capacity;
+}
+
+int intern_const(Chunk *chunk, Val value) {
+    if(!is_indexed(value))
+        return add_const(chunk, value);
+    if(chunk->const_index_capacity > 0) {
+        int *bucket = find_bucket(chunk->const_index, chunk->const_index_capacity,
+                                  chunk->constants.values, value);
+        if(*bucket != 0) return *bucket - 1;
+    }
+
+    /* grow before adding, nothing may collect between add_const and the
+     * caller's write barrier */
+    while((chunk->constants.count + 1) * 4 > chunk->const_index_capacity * 3) {
+        push(value);
+        grow_index(chunk);
+        pop();
+    }
+    int constant = add_const(chunk, value);
+    *find_bucket(chunk->const_index, chunk->const_index_capacity,
+                 chunk->constants.values, value) = constant + 1;
+    return constant;
+}
+
 //The dynamic array of codes start as completely empty
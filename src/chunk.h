@@ -38,6 +38,7 @@ typedef enum {
   OP_JUMP_IF_FALSE,
   OP_LOOP,
   OP_CALL,
+  OP_TAIL_CALL,  // CALL whose result the caller returns right away
   OP_INVOKE,
   OP_SUPER_INVOKE,
   OP_CLOSURE,
@@ -45,7 +46,28 @@ typedef enum {
   OP_RETURN,
   OP_CLASS,
   OP_INHERIT,
-  OP_METHOD
+  OP_METHOD,
+  /* wide forms, for operands that don't fit in a byte. constants take
+   * 24 bits, locals and upvalues 16 */
+  OP_CONSTANT_LONG,
+  OP_GET_LOCAL_LONG,
+  OP_SET_LOCAL_LONG,
+  OP_GET_UPVALUE_LONG,
+  OP_SET_UPVALUE_LONG,
+  OP_CLOSURE_LONG,     // each capture a flag byte and a 16 bit index
+  /* superinstructions, each one a sequence the compiler fuses */
+  OP_ADD_LOCALS,       // GET_LOCAL a, GET_LOCAL b, ADD
+  OP_ADD_LOCAL_CONST,  // GET_LOCAL a, CONSTANT k, ADD
+  OP_LESS_LOCAL_CONST, // GET_LOCAL a, CONSTANT k, LESS
+  OP_SET_LOCAL_POP,    // SET_LOCAL a, POP
+  /* quickened, run() rewrites a generic op to one of these once it has
+   * seen its operands, and back when they don't fit any more */
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  /* a LOOP whose loop has a trace, or had recording fail for good */
+  OP_LOOP_TRACE
 } OpCode;
 
 typedef struct {
@@ -54,12 +76,18 @@ typedef struct {
     uint8_t *code; //The data code stored along with the bytecode chunk
     int *lines;
     val_array constants;
+    /* open addressed, constant index + 1 of each number and string in
+     * constants, 0 for an empty bucket */
+    int *const_index;
+    int const_index_capacity;
 } Chunk; //A code is a chunk pf size one byte;
 
 void initChunk (Chunk* chunk); //Define in the header file
 void freeChunk(Chunk* chunk); //Free the chunk
 void writeChunk(Chunk *chunk, uint8_t byte, int line); //append a byte to the chunk
 int add_const(Chunk *chunk, Val value); //returns the count
+/* like add_const, but a number or string already in the pool is reused */
+int intern_const(Chunk *chunk, Val value);
 // When the value of count is less than capacity this means that there is remaining space in the array
 #endif
 
@@ -7,10 +7,61 @@
 #include <stdio.h>
 #include <limits.h>
 
+/* pack every Val into a single 64 bit word, build with -DNO_NAN_BOXING
+ * for the portable tagged union */
+#ifndef NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+/* jump from one opcode handler straight to the next through a table of
+ * label addresses, build with -DNO_THREADED_DISPATCH for the portable
+ * switch */
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+/* fuse the hottest opcode sequences into single instructions as they
+ * are emitted, build with -DNO_SUPERINSTRUCTIONS to keep them apart */
+#ifndef NO_SUPERINSTRUCTIONS
+#define SUPERINSTRUCTIONS
+#endif
+
+/* rewrite arithmetic and comparisons in place to versions specialized
+ * to the operands they see, build with -DNO_QUICKENING to keep them
+ * generic */
+#ifndef NO_QUICKENING
+#define QUICKENING
+#endif
+
+/* run functions that don't call, capture or touch upvalues as register
+ * code, build with -DNO_REGISTER_VM to run everything on the stack */
+#ifndef NO_REGISTER_VM
+#define REGISTER_VM
+#endif
+
+/* compile functions that are called often to x86-64 machine code,
+ * build with -DNO_JIT to only interpret them. the code works on
+ * NaN-boxed values */
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) &&      \
+    !defined(NO_JIT)
+#define JIT
+#endif
+
+/* record the path hot loops take and compile it to machine code with
+ * unboxed numbers, build with -DNO_TRACE_JIT to leave loops to the
+ * interpreter */
+#if defined(JIT) && !defined(NO_TRACE_JIT)
+#define TRACE_JIT
+#endif
+
 /* #define DEBUG_PRINT_CODE */
 /* #define DEBUG_TRACE_EXECUTION */
+/* #define DEBUG_STRESS_GC */
+/* #define DEBUG_LOG_GC */
+/* #define DEBUG_PROFILE_OPS */
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 /* #ifdef DEBUG_TRACE_EXECUTION */
 /* int debug() { */
@@ -1,10 +1,12 @@
 #include "compiler.h"
 #include "common.h"
+#include "memory.h"
 #include "scanner.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-/* #include "vm.h" */
+#include "vm.h"
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
@@ -47,10 +49,16 @@ typedef struct {
 } local;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool is_local;
 } up_value;
 
+/* locals and upvalues a function may have, wide ops index them with 16
+ * bits. constants get 24 */
+#define LOCALS_MAX UINT16_COUNT
+#define UPVALUES_MAX UINT16_COUNT
+#define CONSTANTS_MAX (1 << 24)
+
 typedef enum {
     type_function,
     type_script
@@ -62,14 +70,29 @@ typedef struct compiler {
     obj_function *function;
     function_type type;
 
-    local locals[UINT8_COUNT]; //array order analogous to declaration
+    /* both grow as they fill up, most functions need a handful */
+    local *locals; //array order analogous to declaration
     int local_count;
-    up_value upvalues[UINT8_COUNT];
+    int local_capacity;
+    up_value *upvalues;
+    int upvalue_capacity;
     int scope_depth;
+
+    /* where the last two operand instructions start and the last jump
+     * target, -1 for none. a sequence is only fused into a
+     * superinstruction when nothing jumps into its middle */
+    int last_op;
+    int prev_op;
+    int last_label;
+    /* where the last CALL starts, -1 for none */
+    int last_call;
 } compiler;
 
 parser parser_obj;
 compiler *cur = NULL;
+/* a function's compiler after it is popped, while its closure is being
+ * emitted from its upvalues */
+static compiler *closing = NULL;
 Chunk *compile_chunk;
 
 static Chunk *current_chunk() {
@@ -138,50 +161,283 @@ static void emit_two_bytes(uint8_t byte1, uint8_t byte2){
 }
 
 
+/* emit an instruction a superinstruction may start with */
+static void emit_operand_op(uint8_t op, uint8_t operand) {
+    cur->prev_op = cur->last_op;
+    cur->last_op = current_chunk()->count;
+    emit_two_bytes(op, operand);
+}
+
+/* global slots take a 16 bit operand */
+static void emit_global_op(uint8_t op, int slot) {
+    emit_byte(op);
+    emit_two_bytes((uint8_t)(slot >> 8), (uint8_t)(slot & 0xff));
+}
+
+/* op with a byte operand, or its wide form with 16 bits when operand
+ * doesn't fit. the wide form never starts a superinstruction */
+static void emit_sized_op(uint8_t op, uint8_t wide, int operand) {
+    if(operand <= UINT8_MAX) {
+        emit_operand_op(op, (uint8_t)operand);
+        return;
+    }
+    cur->last_op = cur->prev_op = -1;
+    emit_byte(wide);
+    emit_two_bytes((uint8_t)(operand >> 8), (uint8_t)(operand & 0xff));
+}
+
+/* the current offset becomes a jump target */
+static int mark_label() {
+    cur->last_label = current_chunk()->count;
+    return cur->last_label;
+}
+
+#ifdef SUPERINSTRUCTIONS
+/* GET_LOCAL a, then `second` b, then op run as fused a b */
+static const struct {
+    uint8_t second;
+    uint8_t op;
+    uint8_t fused;
+} fusions[] = {
+    {OP_GET_LOCAL, OP_ADD,  OP_ADD_LOCALS},
+    {OP_CONSTANT,  OP_ADD,  OP_ADD_LOCAL_CONST},
+    {OP_CONSTANT,  OP_LESS, OP_LESS_LOCAL_CONST},
+};
+
+static bool fuse_binary(uint8_t op) {
+    Chunk *chunk = current_chunk();
+    int first = cur->prev_op;
+    if(first == -1 || first != chunk->count - 4 || cur->last_op != chunk->count - 2
+            || cur->last_label > first || chunk->code[first] != OP_GET_LOCAL)
+        return false;
+
+    for(size_t i = 0; i < sizeof(fusions) / sizeof(fusions[0]); i++) {
+        if(fusions[i].op != op || fusions[i].second != chunk->code[first + 2])
+            continue;
+        chunk->code[first] = fusions[i].fused;
+        chunk->code[first + 2] = chunk->code[first + 3];
+        chunk->count = first + 3;
+        cur->last_op = cur->prev_op = -1;
+        return true;
+    }
+    return false;
+}
+
+static bool fuse_pop() {
+    Chunk *chunk = current_chunk();
+    int first = cur->last_op;
+    if(first == -1 || first != chunk->count - 2 || cur->last_label > first
+            || chunk->code[first] != OP_SET_LOCAL)
+        return false;
+
+    chunk->code[first] = OP_SET_LOCAL_POP;
+    cur->last_op = cur->prev_op = -1;
+    return true;
+}
+#endif
+
+/* emit a binary operator, fused with its operands where possible */
+static void emit_binary(uint8_t op) {
+#ifdef SUPERINSTRUCTIONS
+    if(fuse_binary(op)) return;
+#endif
+    emit_byte(op);
+}
+
+/* emit the pop of a statement's value, fused with a local store where possible */
+static void emit_pop() {
+#ifdef SUPERINSTRUCTIONS
+    if(fuse_pop()) return;
+#endif
+    emit_byte(OP_POP);
+}
+
 static void emit_return() {
     emit_byte(OP_NIL);
     emit_byte(OP_RETURN);
 }
 
-static uint8_t make_constant(Val value) {
-    int constant = add_const(current_chunk(), value);
-    if(constant > UINT8_MAX) {
-        error("byte overflow in chunk");
+static int make_constant(Val value) {
+    int constant = intern_const(current_chunk(), value);
+    /* the function may have been promoted while it is being compiled */
+    write_barrier((Obj*)cur->function, value);
+    if(constant >= CONSTANTS_MAX) {
+        error("too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
+}
+
+/* the 24 bit operand of a wide op naming a constant */
+static void emit_long_operand(int constant) {
+    emit_byte((uint8_t)(constant >> 16));
+    emit_two_bytes((uint8_t)((constant >> 8) & 0xff), (uint8_t)(constant & 0xff));
 }
 
 static void emit_constant(Val value) {
-    emit_two_bytes(OP_CONSTANT, make_constant(value));
+    int constant = make_constant(value);
+    if(constant <= UINT8_MAX) {
+        emit_operand_op(OP_CONSTANT, (uint8_t)constant);
+        return;
+    }
+    cur->last_op = cur->prev_op = -1;
+    emit_byte(OP_CONSTANT_LONG);
+    emit_long_operand(constant);
+}
+
+/* the next local slot of the current function */
+static local *new_local() {
+    if(cur->local_count == cur->local_capacity) {
+        int capacity = GROW_CAPACITY(cur->local_capacity);
+        cur->locals = GROW_ARRAY(local, cur->locals, cur->local_capacity, capacity);
+        cur->local_capacity = capacity;
+    }
+    return &cur->locals[cur->local_count++];
 }
 
-static void init_compiler(compiler *comp, function_type type) {
+/* compilers live on the heap, so a compile() unwound by running out of
+ * memory can still free them */
+static compiler *new_compiler(function_type type) {
+    compiler *comp = ALLOCATE(compiler, 1);
     comp->encl = cur;
     comp->function = NULL;
     comp->type = type;
+    comp->locals = NULL;
     comp->local_count = 0;
+    comp->local_capacity = 0;
+    comp->upvalues = NULL;
+    comp->upvalue_capacity = 0;
     comp->scope_depth = 0;
+    comp->last_op = -1;
+    comp->prev_op = -1;
+    comp->last_label = -1;
+    comp->last_call = -1;
+    cur = comp;
     //new function to compile into
     comp->function = new_function();
-    cur = comp;
     if(type != type_script) {
-        cur->function->name = copy_string(parser_obj.previous.start, parser_obj.previous.length);
+        STORE_REF(cur->function, cur->function->name,
+                copy_string(parser_obj.previous.start, parser_obj.previous.length));
     }
-    local *loc = &cur->locals[cur->local_count++];
+    local *loc = new_local();
     loc->depth = 0;
     loc->name.start = "";
     loc->name.length = 0;
+    return comp;
+}
+
+static void free_compiler(compiler *comp) {
+    FREE_ARRAY(local, comp->locals, comp->local_capacity);
+    FREE_ARRAY(up_value, comp->upvalues, comp->upvalue_capacity);
+    FREE_ARRAY(compiler, comp, 1);
+}
+
+/* bytes of the op at offset and the values it leaves on the stack less
+ * the ones it takes */
+static int stack_effect(Chunk *chunk, int offset, int *length) {
+    uint8_t *ip = chunk->code + offset;
+    *length = 1;
+    switch(*ip) {
+        case OP_NIL: case OP_TRUE: case OP_FALSE:
+            return 1;
+        case OP_POP: case OP_EQUAL: case OP_GREATER: case OP_LESS:
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+        case OP_PRINT: case OP_CLOSE_UPVALUE: case OP_RETURN:
+        case OP_ADD_NUM: case OP_ADD_STR: case OP_GREATER_NUM: case OP_LESS_NUM:
+            return -1;
+        case OP_NOT: case OP_NEGATE:
+            return 0;
+        case OP_CONSTANT: case OP_GET_LOCAL: case OP_GET_UPVALUE:
+            *length = 2;
+            return 1;
+        case OP_SET_LOCAL: case OP_SET_UPVALUE:
+            *length = 2;
+            return 0;
+        case OP_SET_LOCAL_POP:
+            *length = 2;
+            return -1;
+        case OP_CALL: case OP_TAIL_CALL:
+            *length = 2;
+            return -ip[1];
+        case OP_GET_GLOBAL: case OP_GET_LOCAL_LONG: case OP_GET_UPVALUE_LONG:
+        case OP_ADD_LOCALS: case OP_ADD_LOCAL_CONST: case OP_LESS_LOCAL_CONST:
+            *length = 3;
+            return 1;
+        case OP_SET_GLOBAL: case OP_SET_LOCAL_LONG: case OP_SET_UPVALUE_LONG:
+        case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_LOOP: case OP_LOOP_TRACE:
+            *length = 3;
+            return 0;
+        case OP_DEF_GLOBAL:
+            *length = 3;
+            return -1;
+        case OP_CONSTANT_LONG:
+            *length = 4;
+            return 1;
+        case OP_CLOSURE:
+            *length = 2 + 2 * AS_FUNCTION(chunk->constants.values[ip[1]])->up_count;
+            return 1;
+        case OP_CLOSURE_LONG: {
+            int constant = (ip[1] << 16) | (ip[2] << 8) | ip[3];
+            *length = 4 + 3 * AS_FUNCTION(chunk->constants.values[constant])->up_count;
+            return 1;
+        }
+        default:
+            /* the compiler emits no other ops */
+            return 0;
+    }
+}
+
+/* the most values a frame of the finished chunk has on the stack at
+ * once, counting from its callee slot. forward jumps note the depth at
+ * their target, which the code after an op that doesn't fall through
+ * picks up; loops jump back to a depth already seen */
+static int max_stack(Chunk *chunk, int arity) {
+    int *targets = ALLOCATE(int, chunk->count + 1);
+    for(int i = 0; i <= chunk->count; i++)
+        targets[i] = -1;
+    int depth = arity + 1;
+    int max = depth;
+    bool falls_through = true;
+    int length;
+    for(int offset = 0; offset < chunk->count; offset += length) {
+        if(targets[offset] != -1)
+            depth = falls_through && depth > targets[offset] ? depth : targets[offset];
+        uint8_t op = chunk->code[offset];
+        depth += stack_effect(chunk, offset, &length);
+        if(depth > max)
+            max = depth;
+        if(op == OP_JUMP || op == OP_JUMP_IF_FALSE) {
+            int target = offset + 3 + ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+            if(target <= chunk->count && depth > targets[target])
+                targets[target] = depth;
+        }
+        falls_through = op != OP_JUMP && op != OP_LOOP && op != OP_LOOP_TRACE
+            && op != OP_RETURN;
+    }
+    FREE_ARRAY(int, targets, chunk->count + 1);
+    return max;
 }
 
 static obj_function *wrap_compiler() {
     emit_return();
     obj_function *function = cur->function;
+    if(!parser_obj.had_error)
+        function->max_stack = max_stack(&function->chunk, function->arity);
+#ifdef REGISTER_VM
+    /* the function is still reachable through cur while this allocates */
+    if(!parser_obj.had_error && cur->type == type_function)
+        function->registers = compile_registers(&function->chunk, function->arity);
+    /* register code keeps its constants above the deepest stack value */
+    if(function->registers != NULL && REG_COUNT(function->registers) > function->max_stack)
+        function->max_stack = REG_COUNT(function->registers);
+#endif
 
 #ifdef DEBUG_PRINT_CODE
     if(!parser_obj.had_error) {
         disassembleChunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+        if(function->registers != NULL)
+            disassemble_registers(function->registers, function->name->chars);
     }
 #endif
     /* when the fn compiler is done , simply pops itself off the stack
@@ -210,10 +466,10 @@ static void binary(bool assignable) {
         case TOKEN_EQUAL_EQUAL:   emit_byte(OP_EQUAL); break;
         case TOKEN_GREATER:       emit_byte(OP_GREATER); break;
         case TOKEN_GREATER_EQUAL: emit_two_bytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:        emit_byte(OP_LESS); break;                       
+        case TOKEN_LESS:        emit_binary(OP_LESS); break;                       
         case TOKEN_LESS_EQUAL:  emit_two_bytes(OP_GREATER, OP_NOT); break;
         case TOKEN_MINUS:       emit_byte(OP_SUBTRACT); break;
-        case TOKEN_PLUS:        emit_byte(OP_ADD); break;
+        case TOKEN_PLUS:        emit_binary(OP_ADD); break;
         case TOKEN_SLASH:       emit_byte(OP_DIVIDE); break;
         case TOKEN_STAR:        emit_byte(OP_MULTIPLY); break;
         default: return;
@@ -248,7 +504,18 @@ static void grouping(bool assignable) {
 
 
 static void number(bool assignable) {
-    double value = strtod(parser_obj.previous.start, NULL);
+    const char *start = parser_obj.previous.start;
+    /* literals without a fraction are integers, as long as they fit
+     * in 64 bits */
+    if(memchr(start, '.', parser_obj.previous.length) == NULL) {
+        errno = 0;
+        long long value = strtoll(start, NULL, 10);
+        if(errno == 0) {
+            emit_constant(integer_val(value));
+            return;
+        }
+    }
+    double value = strtod(start, NULL);
     emit_constant(NUMBER_VAL(value));
 }
 
@@ -256,23 +523,27 @@ static void string(bool assignable) {
     emit_constant(OBJ_VAL(copy_string(parser_obj.previous.start + 1, parser_obj.previous.length - 2)));
     /* trim the first and the last quote */
 }
-static uint8_t iden_constant(token *tok) {
-    /* add the lexeme of the given token to the chunk constant table 
-     * return the respective index
-     * global vars should be looked up by their names at runtime.
-     * therefore, too avoid storing the whole string into the bytecode stream,
-     * save it in the constant table
+static int resolve_global(token *tok) {
+    /* resolve the lexeme of the given token to its slot in
+     * vm.global_values, so the vm indexes the slot instead of
+     * looking the name up at runtime. every chunk naming the
+     * global agrees on the slot, which is defined or not at runtime
      * */
-    return make_constant(OBJ_VAL(copy_string(tok->start, tok->length)));
+    int slot = global_slot(copy_string(tok->start, tok->length));
+    if(slot > UINT16_MAX) {
+        error("too many global variables.");
+        return 0;
+    }
+    return slot;
 }
 
 static void add_local(token name) {
-    if(cur->local_count == UINT8_COUNT) {
+    if(cur->local_count == LOCALS_MAX) {
         error("too many local variables declared in function");
         return;
     }
 
-    local *loc = &cur->locals[cur->local_count++];
+    local *loc = new_local();
     loc->name = name;
     loc->depth = -1;
     loc->captured = false;
@@ -332,17 +603,23 @@ static int resolve(compiler *comp, token *name) {
     return -1;
 }
 
-static int add_upvalue(compiler *comp, uint8_t index, bool local) {
+static int add_upvalue(compiler *comp, uint16_t index, bool local) {
     int count = comp->function->up_count;
     for(int i = 0; i < count; i++) {
         up_value *value = &comp->upvalues[i];
         if(value->index == index && value->is_local == local)
             return i; 
     }
-    if(count == UINT8_COUNT) {
+    if(count == UPVALUES_MAX) {
         error("too many closure vars in function");
         return 0;
     }
+    if(count == comp->upvalue_capacity) {
+        int capacity = GROW_CAPACITY(comp->upvalue_capacity);
+        comp->upvalues = GROW_ARRAY(up_value, comp->upvalues, comp->upvalue_capacity,
+                capacity);
+        comp->upvalue_capacity = capacity;
+    }
     comp->upvalues[count].is_local = local;
     comp->upvalues[count].index = index;
     return comp->function->up_count++;
@@ -355,41 +632,50 @@ static int resolve_upvalue(compiler *comp, token *name) {
 
     if(loc != -1) {
         comp->encl->locals[loc].captured = true;
-        return add_upvalue(comp, (uint8_t)loc, true);
+        return add_upvalue(comp, (uint16_t)loc, true);
 
     }
     int upvalue = resolve_upvalue(comp->encl, name);
 
     if(upvalue != -1)
-        return add_upvalue(comp, (uint8_t)upvalue, false);
+        return add_upvalue(comp, (uint16_t)upvalue, false);
 
     return -1;
 }
 
 static void named_var(token name, bool assignable) {
     /* take the current token, add it's lexeme to the constant table */
-    uint8_t get_opcode, set_opcode;
+    uint8_t get_opcode, set_opcode, get_wide, set_wide;
     int arg = resolve(cur, &name);
     if(arg != -1) {
         get_opcode = OP_GET_LOCAL;
         set_opcode = OP_SET_LOCAL;
+        get_wide = OP_GET_LOCAL_LONG;
+        set_wide = OP_SET_LOCAL_LONG;
     }
     else if((arg = resolve_upvalue(cur, &name)) != -1) {
         get_opcode = OP_GET_UPVALUE;
         set_opcode = OP_SET_UPVALUE;
+        get_wide = OP_GET_UPVALUE_LONG;
+        set_wide = OP_SET_UPVALUE_LONG;
     }
     else {
-        arg = iden_constant(&name);
-        get_opcode = OP_GET_GLOBAL;
-        set_opcode = OP_SET_GLOBAL;
+        arg = resolve_global(&name);
+        if(match(TOKEN_EQUAL) && assignable) {
+            expression();
+            emit_global_op(OP_SET_GLOBAL, arg);
+        }
+        else
+            emit_global_op(OP_GET_GLOBAL, arg);
+        return;
     }
     /* handle assignment */
     if(match(TOKEN_EQUAL) && assignable) {
         expression();
-        emit_two_bytes(set_opcode, (uint8_t)arg);
+        emit_sized_op(set_opcode, set_wide, arg);
     }
     else
-        emit_two_bytes(get_opcode, (uint8_t)arg);
+        emit_sized_op(get_opcode, get_wide, arg);
 }
 
 static void variable(bool assignable) {
@@ -404,7 +690,7 @@ static int emit_jump(uint8_t inst) {
 }
 
 static void patch_jump(int offset) {
-    int jump = current_chunk()->count - offset - 2;
+    int jump = mark_label() - offset - 2;
     if(jump > UINT16_MAX) {
         error("too much code in the block to jump.");
     }
@@ -468,6 +754,7 @@ static uint8_t arg_list() {
 
 static void call(bool assignable) {
     uint8_t arg_count = arg_list();
+    cur->last_call = current_chunk()->count;
     emit_two_bytes(OP_CALL, arg_count);
 }
 
@@ -548,14 +835,13 @@ static void parse_precedence(precedence precede){
 
 
 
-//(TODO) rename iden_constant
-static uint8_t parse_variable(const char *err_message) {
+static int parse_variable(const char *err_message) {
     /* next token must be an identifier */
     consume(TOKEN_IDENTIFIER, err_message);
     local_decl();
     if(cur->scope_depth > 0)
         return 0;
-    return iden_constant(&parser_obj.previous);
+    return resolve_global(&parser_obj.previous);
 }
 
 static void mark_init() {
@@ -563,14 +849,14 @@ static void mark_init() {
     cur->locals[cur->local_count - 1].depth = cur->scope_depth;
 }
 
-static void var_define(uint8_t global) {
+static void var_define(int global) {
     /* recieves the bytecode */ 
     if(cur->scope_depth > 0) {
         mark_init();
         return;
     }
 
-    emit_two_bytes(OP_DEF_GLOBAL, global);
+    emit_global_op(OP_DEF_GLOBAL, global);
 }
 
 static parse_rule *get_rule(token_type type) {
@@ -582,7 +868,7 @@ static void expression() {
 }
 
 static void var_declare() {
-    uint8_t global_var = parse_variable("expected variable name.");
+    int global_var = parse_variable("expected variable name.");
 
     if(match(TOKEN_EQUAL)) 
         expression();  //compile
@@ -656,8 +942,7 @@ static void block() {
 }
 
 static void function(function_type type) {
-    compiler comp;
-    init_compiler(&comp, type);
+    compiler *comp = new_compiler(type);
     begin_scope();
     consume(TOKEN_LEFT_PAREN, "expected '(' after fn name.");
     if(!check(TOKEN_RIGHT_PAREN)){
@@ -666,7 +951,7 @@ static void function(function_type type) {
             if(cur->function->arity > 255) {
                 error("more than 255 params not allowed in function call.");
             }
-            uint8_t constant = parse_variable("expected param name.") ;
+            int constant = parse_variable("expected param name.") ;
             var_define(constant);
         } while(match(TOKEN_COMMA));
     }
@@ -675,19 +960,33 @@ static void function(function_type type) {
     consume(TOKEN_LEFT_BRACE, "expected '{' to begin function body.");
     block();
     obj_function *fn = wrap_compiler();
-    emit_two_bytes(OP_CLOSURE, make_constant(OBJ_VAL(fn)));
-
+    closing = comp;
+    int constant = make_constant(OBJ_VAL(fn));
+    bool wide = constant > UINT8_MAX;
+    for(int i = 0; i < fn->up_count; i++)
+        wide = wide || comp->upvalues[i].index > UINT8_MAX;
+
+    if(wide) {
+        emit_byte(OP_CLOSURE_LONG);
+        emit_long_operand(constant);
+    }
+    else
+        emit_two_bytes(OP_CLOSURE, (uint8_t)constant);
     for(int i = 0; i < fn->up_count; i++) {
-        emit_byte(comp.upvalues[i].is_local ? 1 : 0);
-        emit_byte(comp.upvalues[i].index);
+        emit_byte(comp->upvalues[i].is_local ? 1 : 0);
+        if(wide)
+            emit_byte((uint8_t)(comp->upvalues[i].index >> 8));
+        emit_byte((uint8_t)(comp->upvalues[i].index & 0xff));
     }
+    closing = NULL;
+    free_compiler(comp);
 
     /* emit_two_bytes(OP_CONSTANT, make_constant(OBJ_VAL(fn))); */
 
 }
 
 static void fn_declare() {
-    uint8_t global = parse_variable("expected function name.");
+    int global = parse_variable("expected function name.");
     mark_init();
     function(type_function);
     var_define(global);
@@ -740,7 +1039,7 @@ static void emit_loop(int loop_start) {
 }
 
 static void while_statement() {
-    int loop_start = current_chunk()->count;
+    int loop_start = mark_label();
     consume(TOKEN_LEFT_PAREN, "expected '(' after while.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "expected ')' after condition.");
@@ -768,7 +1067,7 @@ static void for_statement() {
         consume(TOKEN_SEMICOLON, "expected ';' after return statement.");
         emit_byte(OP_RETURN);
     }
-    int loop_start = current_chunk()->count;
+    int loop_start = mark_label();
 
     /* condition clause */
 
@@ -783,9 +1082,9 @@ static void for_statement() {
 
     if(!match(TOKEN_RIGHT_PAREN)) {
         int body_jump = emit_jump(OP_JUMP);
-        int increment = current_chunk()->count;
+        int increment = mark_label();
         expression();
-        emit_byte(OP_POP);
+        emit_pop();
         consume(TOKEN_RIGHT_PAREN, "expected ')' after for clauses.");
 
         emit_loop(loop_start);
@@ -814,6 +1113,11 @@ static void return_statement() {
     else {
         expression();
         consume(TOKEN_SEMICOLON, "expected ';' after return statement.");
+        /* `return f(...)` reuses the frame for f. the RETURN stays,
+         * and/or jumps over the call land on it */
+        Chunk *chunk = current_chunk();
+        if(cur->last_call != -1 && cur->last_call == chunk->count - 2)
+            chunk->code[cur->last_call] = OP_TAIL_CALL;
         emit_byte(OP_RETURN);
     }
 }
@@ -842,14 +1146,13 @@ static void statement() {
         /* got an expression evaluation */
         expression();  //compile
         consume(TOKEN_SEMICOLON, "expected ';' after expression");
-        emit_byte(OP_POP);
+        emit_pop();
     }
 }
 
 obj_function *compile(const char *source) {
     init_scanner(source);
-    compiler comp;
-    init_compiler(&comp, type_script);
+    compiler *comp = new_compiler(type_script);
 
     parser_obj.had_error = false;
     parser_obj.panic = false;
@@ -860,11 +1163,34 @@ obj_function *compile(const char *source) {
     }
 
     obj_function *fun = wrap_compiler();
+    free_compiler(comp);
 
     return parser_obj.had_error ? NULL : fun;
 
 }
 
+/* free the compilers of a compile() that never returned */
+void abort_compile() {
+    if(closing != NULL) {
+        free_compiler(closing);
+        closing = NULL;
+    }
+    while(cur != NULL) {
+        compiler *encl = cur->encl;
+        free_compiler(cur);
+        cur = encl;
+    }
+}
+
+/* the functions being compiled are only reachable through the compiler chain */
+void mark_compiler_roots() {
+    compiler *comp = cur;
+    while(comp != NULL) {
+        mark_object((Obj*)comp->function);
+        comp = comp->encl;
+    }
+}
+
 
 /* 
  * the language at the moment consists of only
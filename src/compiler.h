@@ -6,6 +6,8 @@
 #include "scanner.h"
 
 obj_function *compile(const char *source);
+void mark_compiler_roots();
+void abort_compile();
 
 void special_error(const char *msg);
 /* void error_at(token *tok, const char *message); */
@@ -1,7 +1,9 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
+#include <inttypes.h>
 #include <stdio.h>
 
 void disassembleChunk(Chunk* chunk, const char *name){
@@ -28,9 +30,73 @@ static int const_instruction(const char *name, Chunk *chunk,
 
 static int byte_instruction(const char *inst, Chunk *chunk, int offset) {
         uint8_t slot = chunk->code[offset + 1];
-        printf("%-16s %4d", inst, slot);
+        printf("%-16s %4d\n", inst, slot);
         return offset + 2;
 }
+static int local_const_instruction(const char *name, Chunk *chunk, int offset) {
+        uint8_t slot = chunk->code[offset + 1];
+        uint8_t constant = chunk->code[offset + 2];
+        printf("%-16s %4d %4d  ", name, slot, constant);
+        print_val(chunk->constants.values[constant]);
+        printf("\n");
+        return offset + 3;
+}
+
+static int two_byte_instruction(const char *name, Chunk *chunk, int offset) {
+        printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+        return offset + 3;
+}
+
+static int short_instruction(const char *name, Chunk *chunk, int offset) {
+        printf("%-16s %4d\n", name, (chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+        return offset + 3;
+}
+
+static int long_const_instruction(const char *name, Chunk *chunk, int offset) {
+        int constant = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8)
+                | chunk->code[offset + 3];
+        printf("%-16s %4d  ", name, constant);
+        print_val(chunk->constants.values[constant]);
+        printf("\n");
+        return offset + 4;
+}
+
+/* the function and, for each of its upvalues, where it is captured from */
+static int closure_instruction(const char *name, Chunk *chunk, int offset, bool wide) {
+        int constant;
+        if(wide) {
+                constant = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8)
+                        | chunk->code[offset + 3];
+                offset += 4;
+        }
+        else {
+                constant = chunk->code[offset + 1];
+                offset += 2;
+        }
+        printf("%-16s %4d", name, constant);
+        print_val(chunk->constants.values[constant]);
+        printf("\n");
+        obj_function *fn = AS_FUNCTION(chunk->constants.values[constant]);
+        for (int x = 0; x < fn->up_count; x++) {
+                int start = offset;
+                int lc = chunk->code[offset++];
+                int index = chunk->code[offset++];
+                if(wide)
+                        index = (index << 8) | chunk->code[offset++];
+                printf("%04d  |         %s %d\n", start, lc ? "local" : "upvalue", index);
+        }
+        return offset;
+}
+
+static int global_instruction(const char *name, Chunk *chunk, int offset) {
+        uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+        slot |= chunk->code[offset + 2];
+        printf("%-16s %4d  ", name, slot);
+        print_val(vm.global_names.values[slot]);
+        printf("\n");
+        return offset + 3;
+}
+
 static int jump_instruction(const char *name, int sign, Chunk *chunk, int offset){
         uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
         jump |= chunk->code[offset + 2];
@@ -59,35 +125,25 @@ int disassembleInstruction(Chunk* chunk, int offset) {
                 case OP_PRINT:
                         return simpleInstruction("OP_PRINT", offset);
                 case OP_GET_GLOBAL:
-                        return const_instruction("OP_GET_GLOBAL", chunk, offset);
+                        return global_instruction("OP_GET_GLOBAL", chunk, offset);
                 case OP_SET_GLOBAL:
-                        return const_instruction("OP_SET_GLOBAL", chunk, offset);
+                        return global_instruction("OP_SET_GLOBAL", chunk, offset);
                 case OP_POP:
                         return simpleInstruction("OP_POP", offset);
                 case OP_DEF_GLOBAL:
-                        return const_instruction("OP_DEF_GLOBAL", chunk, offset);
+                        return global_instruction("OP_DEF_GLOBAL", chunk, offset);
                 case OP_CALL:
                         return byte_instruction("OP_CALL", chunk, offset);
+                case OP_TAIL_CALL:
+                        return byte_instruction("OP_TAIL_CALL", chunk, offset);
                 case OP_SET_UPVALUE:
                         return byte_instruction("OP_SET_UPVALUE", chunk, offset);
                 case OP_GET_UPVALUE:
                         return byte_instruction("OP_GET_UPVALUE", chunk, offset);
                 case OP_CLOSE_UPVALUE:
                         return simpleInstruction("OP_CLOSE_UPVALUE", offset);
-                case OP_CLOSURE: {
-                                         offset++;
-                                         uint8_t constant = chunk->code[offset++];
-                                         printf("%-16s %4d","OP_CLOSURE", constant);
-                                         print_val(chunk->constants.values[constant]);
-                                         printf("\n");
-                                         obj_function *fn = AS_FUNCTION(chunk->constants.values[constant]);
-                                         for (int x = 0; x < fn->up_count; x++) {
-                                                 int lc = chunk->code[offset++];
-                                                 int index = chunk->code[offset++];
-                                                 printf("%04d  |         %s %d\n", offset - 2 , lc ? "local" : "upvalue", index);
-                                         }
-                                         return offset;
-                                 }
+                case OP_CLOSURE:
+                        return closure_instruction("OP_CLOSURE", chunk, offset, false);
                 case OP_GET_LOCAL:
                         return byte_instruction("OP_GET_LOCAL", chunk, offset);
                 case OP_SET_LOCAL:
@@ -120,9 +176,212 @@ int disassembleInstruction(Chunk* chunk, int offset) {
                         return simpleInstruction("OP_TRUE", offset);
                 case OP_FALSE:
                         return simpleInstruction("OP_FALSE", offset);
+                case OP_ADD_LOCALS:
+                        return two_byte_instruction("OP_ADD_LOCALS", chunk, offset);
+                case OP_ADD_LOCAL_CONST:
+                        return local_const_instruction("OP_ADD_LOCAL_CONST", chunk, offset);
+                case OP_LESS_LOCAL_CONST:
+                        return local_const_instruction("OP_LESS_LOCAL_CONST", chunk, offset);
+                case OP_SET_LOCAL_POP:
+                        return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+                case OP_ADD_NUM:
+                        return simpleInstruction("OP_ADD_NUM", offset);
+                case OP_ADD_STR:
+                        return simpleInstruction("OP_ADD_STR", offset);
+                case OP_GREATER_NUM:
+                        return simpleInstruction("OP_GREATER_NUM", offset);
+                case OP_LESS_NUM:
+                        return simpleInstruction("OP_LESS_NUM", offset);
+                case OP_LOOP_TRACE:
+                        return jump_instruction("OP_LOOP_TRACE", -1, chunk, offset);
+                case OP_CONSTANT_LONG:
+                        return long_const_instruction("OP_CONSTANT_LONG", chunk, offset);
+                case OP_GET_LOCAL_LONG:
+                        return short_instruction("OP_GET_LOCAL_LONG", chunk, offset);
+                case OP_SET_LOCAL_LONG:
+                        return short_instruction("OP_SET_LOCAL_LONG", chunk, offset);
+                case OP_GET_UPVALUE_LONG:
+                        return short_instruction("OP_GET_UPVALUE_LONG", chunk, offset);
+                case OP_SET_UPVALUE_LONG:
+                        return short_instruction("OP_SET_UPVALUE_LONG", chunk, offset);
+                case OP_CLOSURE_LONG:
+                        return closure_instruction("OP_CLOSURE_LONG", chunk, offset, true);
                 default:
                         printf("Unknown opcode %d\n", instruction);
                         return offset + 1;
         }
 }
 
+
+static const char *reg_names[] = {
+        [REG_MOVE] = "MOVE", [REG_GET_GLOBAL] = "GET_GLOBAL",
+        [REG_EQUAL] = "EQUAL", [REG_GREATER] = "GREATER", [REG_LESS] = "LESS",
+        [REG_ADD] = "ADD", [REG_SUBTRACT] = "SUBTRACT",
+        [REG_MULTIPLY] = "MULTIPLY", [REG_DIVIDE] = "DIVIDE",
+        [REG_NOT] = "NOT", [REG_NEGATE] = "NEGATE", [REG_PRINT] = "PRINT",
+        [REG_JUMP] = "JUMP", [REG_JUMP_IF_FALSE] = "JUMP_IF_FALSE",
+        [REG_RETURN] = "RETURN",
+};
+
+/* registers print as r<n>, constant registers as the constant itself */
+static void print_register(reg_chunk *code, int reg) {
+        if(reg >= code->const_base) {
+                printf(" ");
+                print_val(code->constants[reg - code->const_base]);
+        }
+        else
+                printf(" r%d", reg);
+}
+
+void disassemble_registers(reg_chunk *code, const char *name) {
+        printf("--------%s (registers)---------\n", name);
+        printf("%d registers, constants from r%d\n", REG_COUNT(code), code->const_base);
+        for(int index = 0; index < code->count;)
+                index = disassemble_reg_instruction(code, index);
+}
+
+int disassemble_reg_instruction(reg_chunk *code, int index) {
+        reg_inst inst = code->code[index];
+        printf("%04d  (%04d)  %-16s", index, code->origins[index], reg_names[inst.op]);
+        switch(inst.op) {
+                case REG_GET_GLOBAL:
+                        printf(" r%d  slot %d  ", inst.a, REG_BC(inst));
+                        print_val(vm.global_names.values[REG_BC(inst)]);
+                        break;
+                case REG_MOVE:
+                case REG_NOT:
+                case REG_NEGATE:
+                        printf(" r%d", inst.a);
+                        print_register(code, inst.b);
+                        break;
+                case REG_PRINT:
+                case REG_RETURN:
+                        print_register(code, inst.a);
+                        break;
+                case REG_JUMP:
+                        printf(" -> %d", REG_BC(inst));
+                        break;
+                case REG_JUMP_IF_FALSE:
+                        print_register(code, inst.a);
+                        printf(" -> %d", REG_BC(inst));
+                        break;
+                default:
+                        printf(" r%d", inst.a);
+                        print_register(code, inst.b);
+                        print_register(code, inst.c);
+        }
+        printf("\n");
+        return index + 1;
+}
+
+#ifdef DEBUG_PROFILE_OPS
+
+#define OPCODE_COUNT (OP_LOOP_TRACE + 1)
+/* entries in each of the profile's top lists */
+#define PROFILE_TOP 20
+
+static const char *opcode_names[OPCODE_COUNT] = {
+        [OP_CONSTANT] = "CONSTANT", [OP_NIL] = "NIL", [OP_TRUE] = "TRUE",
+        [OP_FALSE] = "FALSE", [OP_POP] = "POP", [OP_GET_LOCAL] = "GET_LOCAL",
+        [OP_SET_LOCAL] = "SET_LOCAL", [OP_GET_GLOBAL] = "GET_GLOBAL",
+        [OP_DEF_GLOBAL] = "DEF_GLOBAL", [OP_SET_GLOBAL] = "SET_GLOBAL",
+        [OP_GET_UPVALUE] = "GET_UPVALUE", [OP_SET_UPVALUE] = "SET_UPVALUE",
+        [OP_GET_PROPERTY] = "GET_PROPERTY", [OP_SET_PROPERTY] = "SET_PROPERTY",
+        [OP_GET_SUPER] = "GET_SUPER", [OP_EQUAL] = "EQUAL",
+        [OP_GREATER] = "GREATER", [OP_LESS] = "LESS", [OP_ADD] = "ADD",
+        [OP_SUBTRACT] = "SUBTRACT", [OP_MULTIPLY] = "MULTIPLY",
+        [OP_DIVIDE] = "DIVIDE", [OP_NOT] = "NOT", [OP_NEGATE] = "NEGATE",
+        [OP_PRINT] = "PRINT", [OP_JUMP] = "JUMP",
+        [OP_JUMP_IF_FALSE] = "JUMP_IF_FALSE", [OP_LOOP] = "LOOP",
+        [OP_CALL] = "CALL", [OP_TAIL_CALL] = "TAIL_CALL",
+        [OP_INVOKE] = "INVOKE", [OP_SUPER_INVOKE] = "SUPER_INVOKE",
+        [OP_CLOSURE] = "CLOSURE",
+        [OP_CLOSE_UPVALUE] = "CLOSE_UPVALUE", [OP_RETURN] = "RETURN",
+        [OP_CLASS] = "CLASS", [OP_INHERIT] = "INHERIT", [OP_METHOD] = "METHOD",
+        [OP_ADD_LOCALS] = "ADD_LOCALS", [OP_ADD_LOCAL_CONST] = "ADD_LOCAL_CONST",
+        [OP_LESS_LOCAL_CONST] = "LESS_LOCAL_CONST",
+        [OP_SET_LOCAL_POP] = "SET_LOCAL_POP", [OP_ADD_NUM] = "ADD_NUM",
+        [OP_ADD_STR] = "ADD_STR", [OP_GREATER_NUM] = "GREATER_NUM",
+        [OP_LESS_NUM] = "LESS_NUM", [OP_LOOP_TRACE] = "LOOP_TRACE",
+        [OP_CONSTANT_LONG] = "CONSTANT_LONG", [OP_GET_LOCAL_LONG] = "GET_LOCAL_LONG",
+        [OP_SET_LOCAL_LONG] = "SET_LOCAL_LONG",
+        [OP_GET_UPVALUE_LONG] = "GET_UPVALUE_LONG",
+        [OP_SET_UPVALUE_LONG] = "SET_UPVALUE_LONG", [OP_CLOSURE_LONG] = "CLOSURE_LONG",
+};
+
+static uint64_t opcode_counts[OPCODE_COUNT];
+static uint64_t pair_counts[OPCODE_COUNT][OPCODE_COUNT];
+static uint64_t triple_counts[OPCODE_COUNT][OPCODE_COUNT][OPCODE_COUNT];
+/* the two opcodes executed last, -1 until there are any */
+static int last_opcode = -1;
+static int before_last_opcode = -1;
+
+void profile_opcode(uint8_t opcode) {
+        if(opcode >= OPCODE_COUNT) return;
+        opcode_counts[opcode]++;
+        if(last_opcode != -1) {
+                pair_counts[last_opcode][opcode]++;
+                if(before_last_opcode != -1)
+                        triple_counts[before_last_opcode][last_opcode][opcode]++;
+        }
+        before_last_opcode = last_opcode;
+        last_opcode = opcode;
+}
+
+/* insert a sequence into a top list sorted by descending count */
+static void keep_top(int top[][3], uint64_t *counts, int *count,
+                     int a, int b, int c, uint64_t key) {
+        if(key == 0) return;
+        if(*count == PROFILE_TOP && key <= counts[PROFILE_TOP - 1]) return;
+        int i = *count < PROFILE_TOP ? (*count)++ : PROFILE_TOP - 1;
+        for(; i > 0 && counts[i - 1] < key; i--) {
+                top[i][0] = top[i - 1][0];
+                top[i][1] = top[i - 1][1];
+                top[i][2] = top[i - 1][2];
+                counts[i] = counts[i - 1];
+        }
+        top[i][0] = a;
+        top[i][1] = b;
+        top[i][2] = c;
+        counts[i] = key;
+}
+
+static void print_top(FILE *out, const char *title, int top[][3],
+                      uint64_t *counts, int count, int length, uint64_t total) {
+        fprintf(out, "%s:\n", title);
+        for(int i = 0; i < count; i++) {
+                fprintf(out, "  %12" PRIu64 " %5.1f%%  ", counts[i],
+                        100.0 * counts[i] / total);
+                for(int j = 0; j < length; j++)
+                        fprintf(out, " %s", opcode_names[top[i][j]]);
+                fputc('\n', out);
+        }
+}
+
+void print_opcode_profile(FILE *out) {
+        uint64_t total = 0;
+        for(int a = 0; a < OPCODE_COUNT; a++)
+                total += opcode_counts[a];
+        if(total == 0) return;
+
+        int pairs[PROFILE_TOP][3];
+        uint64_t pair_keys[PROFILE_TOP];
+        int pair_count = 0;
+        int triples[PROFILE_TOP][3];
+        uint64_t triple_keys[PROFILE_TOP];
+        int triple_count = 0;
+        for(int a = 0; a < OPCODE_COUNT; a++) {
+                for(int b = 0; b < OPCODE_COUNT; b++) {
+                        keep_top(pairs, pair_keys, &pair_count, a, b, 0, pair_counts[a][b]);
+                        for(int c = 0; c < OPCODE_COUNT; c++)
+                                keep_top(triples, triple_keys, &triple_count, a, b, c,
+                                         triple_counts[a][b][c]);
+                }
+        }
+
+        fprintf(out, "opcode profile: %" PRIu64 " instructions\n", total);
+        print_top(out, "most frequent pairs", pairs, pair_keys, pair_count, 2, total);
+        print_top(out, "most frequent triples", triples, triple_keys, triple_count, 3, total);
+}
+
+#endif
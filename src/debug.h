@@ -2,9 +2,19 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "regcode.h"
 
 
 void disassembleChunk(Chunk *chunk, const char* name);
 int disassembleInstruction(Chunk *chunk, int offset);
+void disassemble_registers(reg_chunk *code, const char *name);
+int disassemble_reg_instruction(reg_chunk *code, int index);
+
+#ifdef DEBUG_PROFILE_OPS
+/* count each executed opcode with the one or two executed before it */
+void profile_opcode(uint8_t opcode);
+/* the most frequent pairs and triples, to pick superinstructions from */
+void print_opcode_profile(FILE *out);
+#endif
 
 #endif
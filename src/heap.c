@@ -0,0 +1,253 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+/* entries in each of the census' top lists */
+#define CENSUS_TOP 10
+/* chars of a string shown in the census and the dump */
+#define LABEL_MAX 48
+
+#define TYPE_COUNT (OBJ_INT + 1)
+
+static const char *type_names[TYPE_COUNT] = {
+    [OBJ_CLOSURE]  = "closure",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_NATIVE]   = "native",
+    [OBJ_STRING]   = "string",
+    [OBJ_ROPE]     = "rope",
+    [OBJ_UPVALUE]  = "upvalue",
+    [OBJ_INT]      = "int",
+};
+
+/* the bytes an object keeps alive by itself, its own arrays included */
+static size_t object_size(Obj *object) {
+    switch(object->type) {
+        case OBJ_CLOSURE:
+            return CLOSURE_SIZE(((obj_closure*)object)->upvalue_count);
+        case OBJ_FUNCTION: {
+            obj_function *function = (obj_function*)object;
+            Chunk *chunk = &function->chunk;
+            return sizeof(obj_function)
+                + chunk->capacity * (sizeof(uint8_t) + sizeof(int))
+                + chunk->constants.capacity * sizeof(Val)
+                + chunk->const_index_capacity * sizeof(int)
+                + (function->registers != NULL ? registers_size(function->registers) : 0)
+#ifdef JIT
+                + (function->jit != NULL ? jit_size(function->jit) : 0)
+#endif
+#ifdef TRACE_JIT
+                + traces_size(function->traces)
+#endif
+                ;
+        }
+        case OBJ_NATIVE:
+            return sizeof(obj_native);
+        case OBJ_STRING:
+            return STRING_SIZE(((obj_string*)object)->length);
+        case OBJ_ROPE:
+            return sizeof(obj_rope);
+        case OBJ_UPVALUE:
+            return sizeof(obj_upvalue);
+        case OBJ_INT:
+            return sizeof(obj_int);
+    }
+    return 0;
+}
+
+/* a full collection leaves every live object on one of these two lists */
+static void collect_for_walk(Obj **lists) {
+    collect_garbage();
+    lists[0] = vm.objects;
+    lists[1] = vm.young_objects;
+}
+
+/* print at most max chars, quoted and escaped so one object stays on one line */
+static void print_label(FILE *out, obj_string *string, int max) {
+    fputc('"', out);
+    for(int i = 0; i < string->length && i < max; i++) {
+        unsigned char c = (unsigned char)string->chars[i];
+        if(c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if(c == '\n')
+            fputs("\\n", out);
+        else if(c < 0x20 || c >= 0x7f)
+            fprintf(out, "\\x%02x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+    if(string->length > max)
+        fputs("...", out);
+}
+
+static void print_function_name(FILE *out, obj_function *function) {
+    if(function->name == NULL)
+        fputs("script", out);
+    else
+        fputs(function->name->chars, out);
+}
+
+/* insert object into a top list sorted by descending key */
+static void keep_top(Obj **top, size_t *keys, int *count, Obj *object, size_t key) {
+    if(*count == CENSUS_TOP && key <= keys[CENSUS_TOP - 1]) return;
+    int i = *count < CENSUS_TOP ? (*count)++ : CENSUS_TOP - 1;
+    for(; i > 0 && keys[i - 1] < key; i--) {
+        top[i] = top[i - 1];
+        keys[i] = keys[i - 1];
+    }
+    top[i] = object;
+    keys[i] = key;
+}
+
+void print_heap_census(FILE *out) {
+    size_t counts[TYPE_COUNT] = {0};
+    size_t bytes[TYPE_COUNT] = {0};
+    Obj *strings[CENSUS_TOP];
+    size_t string_keys[CENSUS_TOP];
+    int string_count = 0;
+    Obj *closures[CENSUS_TOP];
+    size_t closure_keys[CENSUS_TOP];
+    int closure_count = 0;
+
+    Obj *lists[2];
+    collect_for_walk(lists);
+    for(int l = 0; l < 2; l++) {
+        for(Obj *object = lists[l]; object != NULL; object = object->next) {
+            counts[object->type]++;
+            bytes[object->type] += object_size(object);
+            if(object->type == OBJ_STRING)
+                keep_top(strings, string_keys, &string_count, object,
+                        ((obj_string*)object)->length);
+            else if(object->type == OBJ_CLOSURE && ((obj_closure*)object)->upvalue_count > 0)
+                keep_top(closures, closure_keys, &closure_count, object,
+                        ((obj_closure*)object)->upvalue_count);
+        }
+    }
+
+    size_t total_count = 0;
+    size_t total_bytes = 0;
+    for(int i = 0; i < TYPE_COUNT; i++) {
+        total_count += counts[i];
+        total_bytes += bytes[i];
+    }
+
+    fprintf(out, "heap census: %zu objects, %zu bytes\n", total_count, total_bytes);
+    fprintf(out, "  %-10s %10s %12s\n", "type", "count", "bytes");
+    for(int i = 0; i < TYPE_COUNT; i++) {
+        if(counts[i] == 0) continue;
+        fprintf(out, "  %-10s %10zu %12zu\n", type_names[i], counts[i], bytes[i]);
+    }
+
+    if(string_count > 0) {
+        fprintf(out, "largest strings:\n");
+        for(int i = 0; i < string_count; i++) {
+            fprintf(out, "  %10zu  ", string_keys[i]);
+            print_label(out, (obj_string*)strings[i], LABEL_MAX);
+            fputc('\n', out);
+        }
+    }
+    if(closure_count > 0) {
+        fprintf(out, "closures with the most upvalues:\n");
+        for(int i = 0; i < closure_count; i++) {
+            fprintf(out, "  %10zu  ", closure_keys[i]);
+            print_function_name(out, ((obj_closure*)closures[i])->function);
+            fputc('\n', out);
+        }
+    }
+}
+
+static void dump_ref(FILE *out, Obj *from, Obj *to) {
+    if(to != NULL)
+        fprintf(out, "ref %p %p\n", (void*)from, (void*)to);
+}
+
+static void dump_ref_value(FILE *out, Obj *from, Val to) {
+    if(IS_OBJ(to))
+        dump_ref(out, from, AS_OBJ(to));
+}
+
+static void dump_root(FILE *out, const char *kind, Val value) {
+    if(IS_OBJ(value))
+        fprintf(out, "root %s %p\n", kind, (void*)AS_OBJ(value));
+}
+
+static void dump_object(FILE *out, Obj *object) {
+    fprintf(out, "object %p %s %zu ", (void*)object,
+            type_names[object->type], object_size(object));
+    switch(object->type) {
+        case OBJ_CLOSURE: {
+            obj_closure *closure = (obj_closure*)object;
+            print_function_name(out, closure->function);
+            fputc('\n', out);
+            dump_ref(out, object, (Obj*)closure->function);
+            for(int i = 0; i < closure->upvalue_count; i++)
+                dump_ref(out, object, (Obj*)closure->upvalues[i]);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            obj_function *function = (obj_function*)object;
+            print_function_name(out, function);
+            fputc('\n', out);
+            dump_ref(out, object, (Obj*)function->name);
+            for(int i = 0; i < function->chunk.constants.count; i++)
+                dump_ref_value(out, object, function->chunk.constants.values[i]);
+            break;
+        }
+        case OBJ_STRING:
+            print_label(out, (obj_string*)object, LABEL_MAX);
+            fputc('\n', out);
+            break;
+        case OBJ_ROPE: {
+            obj_rope *rope = (obj_rope*)object;
+            fprintf(out, "%d\n", rope->length);
+            dump_ref(out, object, rope->left);
+            dump_ref(out, object, rope->right);
+            dump_ref(out, object, (Obj*)rope->flat);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            obj_upvalue *upvalue = (obj_upvalue*)object;
+            fputs(upvalue->location == &upvalue->closed ? "closed\n" : "open\n", out);
+            dump_ref_value(out, object, upvalue->closed);
+            break;
+        }
+        case OBJ_NATIVE:
+            fputs("-\n", out);
+            break;
+        case OBJ_INT:
+            fprintf(out, "%" PRId64 "\n", ((obj_int*)object)->integer);
+            break;
+    }
+}
+
+bool dump_heap(const char *path) {
+    FILE *out = fopen(path, "w");
+    if(out == NULL)
+        return false;
+
+    Obj *lists[2];
+    collect_for_walk(lists);
+
+    fprintf(out, "cpplox heap dump 1\n");
+    for(Val *slot = vm.stack; slot < vm.stack_top; slot++)
+        dump_root(out, "stack", *slot);
+    for(int i = 0; i < vm.frame_count; i++)
+        dump_root(out, "frame", OBJ_VAL(vm.frame[i].closure));
+    for(obj_upvalue *upvalue = vm.open_upvalue; upvalue != NULL; upvalue = upvalue->next)
+        dump_root(out, "upvalue", OBJ_VAL(upvalue));
+    for(int i = 0; i < vm.global_values.count; i++) {
+        dump_root(out, "global", vm.global_names.values[i]);
+        dump_root(out, "global", vm.global_values.values[i]);
+    }
+
+    for(int l = 0; l < 2; l++)
+        for(Obj *object = lists[l]; object != NULL; object = object->next)
+            dump_object(out, object);
+
+    return fclose(out) == 0;
+}
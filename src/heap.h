@@ -0,0 +1,14 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+
+/* both run a full collection first, so they only see live objects */
+
+/* counts and bytes per object type, the largest strings and the
+ * closures holding the most upvalues */
+void print_heap_census(FILE *out);
+/* write the object graph to path, in the format the README describes */
+bool dump_heap(const char *path);
+
+#endif
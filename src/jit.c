@@ -0,0 +1,951 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#ifdef JIT
+
+#include <sys/mman.h>
+
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "trace.h"
+#include "vm.h"
+
+/* the low three bits of a register go into ModRM, the fourth into REX */
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/* the interpreter state lives in callee saved registers */
+#define SP    RBX
+#define SLOTS R12
+#define FRAME R13
+
+/* condition codes, jcc is 0x0f 0x80 + cc and setcc 0x0f 0x90 + cc */
+#define CC_O  0x0
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_A  0x7
+#define CC_NP 0xb
+#define CC_L  0xc
+#define CC_G  0xf
+/* jump() without a condition */
+#define ALWAYS -1
+
+/* the top 16 bits of every integer Val */
+#define INT_TOP ((int32_t)((QNAN | INT_TAG) >> 48))
+
+typedef struct {
+    int at;
+    int target;
+} jump_patch;
+
+typedef struct {
+    Chunk *chunk;
+    uint8_t *code;
+    int count;
+    int capacity;
+    int *entries;
+    /* where the shared exit starts */
+    int exit;
+    /* jumps to chunk offsets, patched once every entry is known */
+    jump_patch *patches;
+    int patch_count;
+    int patch_capacity;
+} assembler;
+
+static void byte(assembler *a, uint8_t b) {
+    if(a->count == a->capacity) {
+        a->capacity = a->capacity < 256 ? 256 : a->capacity * 2;
+        a->code = realloc(a->code, a->capacity);
+        if(a->code == NULL)
+            exit(1);
+    }
+    a->code[a->count++] = b;
+}
+
+static void int32(assembler *a, int32_t value) {
+    for(int i = 0; i < 4; i++)
+        byte(a, (uint8_t)((uint32_t)value >> (8 * i)));
+}
+
+static void int64(assembler *a, uint64_t value) {
+    for(int i = 0; i < 8; i++)
+        byte(a, (uint8_t)(value >> (8 * i)));
+}
+
+/* REX.W with the high bits of the ModRM reg and rm fields */
+static void rex(assembler *a, int reg, int rm) {
+    byte(a, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+/* op reg, [base + disp] */
+static void mem(assembler *a, uint8_t op, int reg, int base, int32_t disp) {
+    rex(a, reg, base);
+    byte(a, op);
+    byte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+    /* rsp and r12 as a base need a SIB byte */
+    if((base & 7) == RSP)
+        byte(a, 0x24);
+    int32(a, disp);
+}
+
+static void load(assembler *a, int reg, int base, int32_t disp) {
+    mem(a, 0x8b, reg, base, disp);
+}
+
+static void store(assembler *a, int base, int32_t disp, int reg) {
+    mem(a, 0x89, reg, base, disp);
+}
+
+/* op rm, reg between two registers */
+static void rr(assembler *a, uint8_t op, int rm, int reg) {
+    rex(a, reg, rm);
+    byte(a, op);
+    byte(a, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+#define MOV(a, dst, src)  rr(a, 0x89, dst, src)
+#define ADD(a, dst, src)  rr(a, 0x01, dst, src)
+#define SUB(a, dst, src)  rr(a, 0x29, dst, src)
+#define OR(a, dst, src)   rr(a, 0x09, dst, src)
+#define AND(a, dst, src)  rr(a, 0x21, dst, src)
+#define XOR(a, dst, src)  rr(a, 0x31, dst, src)
+#define CMP(a, x, y)      rr(a, 0x39, x, y)
+#define TEST(a, x, y)     rr(a, 0x85, x, y)
+
+static void imul(assembler *a, int dst, int src) {
+    rex(a, dst, src);
+    byte(a, 0x0f);
+    byte(a, 0xaf);
+    byte(a, 0xc0 | ((dst & 7) << 3) | (src & 7));
+}
+
+static void push_reg(assembler *a, int reg) {
+    if(reg >= R8)
+        byte(a, 0x41);
+    byte(a, 0x50 + (reg & 7));
+}
+
+static void pop_reg(assembler *a, int reg) {
+    if(reg >= R8)
+        byte(a, 0x41);
+    byte(a, 0x58 + (reg & 7));
+}
+
+static void mov_imm(assembler *a, int reg, uint64_t value) {
+    byte(a, 0x48 | (reg >> 3));
+    byte(a, 0xb8 + (reg & 7));
+    int64(a, value);
+}
+
+#define SHL 4
+#define SHR 5
+#define SAR 7
+
+static void shift(assembler *a, int kind, int reg, uint8_t count) {
+    byte(a, 0x48 | (reg >> 3));
+    byte(a, 0xc1);
+    byte(a, 0xc0 | (kind << 3) | (reg & 7));
+    byte(a, count);
+}
+
+static void add_imm(assembler *a, int reg, int32_t value) {
+    byte(a, 0x48 | (reg >> 3));
+    byte(a, 0x81);
+    byte(a, 0xc0 | (reg & 7));
+    int32(a, value);
+}
+
+/* cmp on the low 32 bits of reg */
+static void cmp32_imm(assembler *a, int reg, int32_t value) {
+    if(reg >= R8)
+        byte(a, 0x41);
+    byte(a, 0x81);
+    byte(a, 0xf8 | (reg & 7));
+    int32(a, value);
+}
+
+/* setcc al, movzx eax al */
+static void set_flag(assembler *a, int cc) {
+    byte(a, 0x0f);
+    byte(a, 0x90 + cc);
+    byte(a, 0xc0);
+    byte(a, 0x0f);
+    byte(a, 0xb6);
+    byte(a, 0xc0);
+}
+
+static void call(assembler *a, void *function) {
+    mov_imm(a, RAX, (uint64_t)(uintptr_t)function);
+    byte(a, 0xff);
+    byte(a, 0xd0);
+}
+
+/* a jump with its rel32 left open, returns where the rel32 is */
+static int jump(assembler *a, int cc) {
+    if(cc == ALWAYS) {
+        byte(a, 0xe9);
+    }
+    else {
+        byte(a, 0x0f);
+        byte(a, 0x80 + cc);
+    }
+    int32(a, 0);
+    return a->count - 4;
+}
+
+static void patch(assembler *a, int at, int target) {
+    int32_t rel = target - (at + 4);
+    memcpy(a->code + at, &rel, 4);
+}
+
+/* the open jump at `at` lands here */
+static void land(assembler *a, int at) {
+    patch(a, at, a->count);
+}
+
+static void jump_to(assembler *a, int cc, int target) {
+    patch(a, jump(a, cc), target);
+}
+
+/* a jump to the code of a chunk offset */
+static void jump_chunk(assembler *a, int cc, int target) {
+    if(a->patch_count == a->patch_capacity) {
+        a->patch_capacity = a->patch_capacity < 8 ? 8 : a->patch_capacity * 2;
+        a->patches = realloc(a->patches, sizeof(jump_patch) * a->patch_capacity);
+        if(a->patches == NULL)
+            exit(1);
+    }
+    a->patches[a->patch_count].at = jump(a, cc);
+    a->patches[a->patch_count].target = target;
+    a->patch_count++;
+}
+
+static void push_rax(assembler *a) {
+    store(a, SP, 0, RAX);
+    add_imm(a, SP, sizeof(Val));
+}
+
+/* hand the op at ip back to run(). pushed values are what the fused
+ * ops pushed before the op they end with, run() starts over */
+static void exit_at(assembler *a, uint8_t *ip, int pushed) {
+    if(pushed > 0)
+        add_imm(a, SP, -pushed * (int32_t)sizeof(Val));
+    mov_imm(a, RAX, (uint64_t)(uintptr_t)ip);
+    store(a, FRAME, offsetof(call_frame, ip), RAX);
+    jump_to(a, ALWAYS, a->exit);
+}
+
+static void slow_path(assembler *a, uint8_t *ip, uint8_t op, int pushed) {
+    MOV(a, RDI, SP);
+    MOV(a, RSI, FRAME);
+    mov_imm(a, RDX, (uint64_t)(uintptr_t)ip);
+    mov_imm(a, RCX, op);
+    call(a, jit_slow_path);
+    TEST(a, RAX, RAX);
+    int ok = jump(a, CC_NE);
+    exit_at(a, ip, pushed);
+    land(a, ok);
+    MOV(a, SP, RAX);
+}
+
+/* rax and rcx get the two operands, both jumps go to the slow path
+ * unless they are integers */
+static void int_operands(assembler *a, int *slow) {
+    load(a, RAX, SP, -2 * (int32_t)sizeof(Val));
+    load(a, RCX, SP, -(int32_t)sizeof(Val));
+    MOV(a, RDX, RAX);
+    shift(a, SHR, RDX, 48);
+    cmp32_imm(a, RDX, INT_TOP);
+    slow[0] = jump(a, CC_NE);
+    MOV(a, RDX, RCX);
+    shift(a, SHR, RDX, 48);
+    cmp32_imm(a, RDX, INT_TOP);
+    slow[1] = jump(a, CC_NE);
+}
+
+/* integers shifted to the top 48 bits add, subtract and multiply
+ * with the overflow flag set exactly when the result doesn't fit */
+static void arith(assembler *a, uint8_t *ip, uint8_t op, int pushed) {
+    int slow[3];
+    int_operands(a, slow);
+    shift(a, SHL, RAX, 16);
+    shift(a, SHL, RCX, 16);
+    switch(op) {
+        case OP_ADD:      ADD(a, RAX, RCX); break;
+        case OP_SUBTRACT: SUB(a, RAX, RCX); break;
+        case OP_MULTIPLY:
+            shift(a, SAR, RCX, 16);
+            imul(a, RAX, RCX);
+            break;
+    }
+    slow[2] = jump(a, CC_O);
+    shift(a, SHR, RAX, 16);
+    mov_imm(a, RCX, QNAN | INT_TAG);
+    OR(a, RAX, RCX);
+    store(a, SP, -2 * (int32_t)sizeof(Val), RAX);
+    add_imm(a, SP, -(int32_t)sizeof(Val));
+    int done = jump(a, ALWAYS);
+    for(int i = 0; i < 3; i++)
+        land(a, slow[i]);
+    slow_path(a, ip, op, pushed);
+    land(a, done);
+}
+
+static void compare(assembler *a, uint8_t *ip, uint8_t op, int pushed) {
+    int slow[2];
+    int_operands(a, slow);
+    shift(a, SHL, RAX, 16);
+    shift(a, SHL, RCX, 16);
+    CMP(a, RAX, RCX);
+    /* FALSE_VAL + 1 is TRUE_VAL */
+    set_flag(a, op == OP_LESS ? CC_L : CC_G);
+    mov_imm(a, RCX, FALSE_VAL);
+    ADD(a, RAX, RCX);
+    store(a, SP, -2 * (int32_t)sizeof(Val), RAX);
+    add_imm(a, SP, -(int32_t)sizeof(Val));
+    int done = jump(a, ALWAYS);
+    land(a, slow[0]);
+    land(a, slow[1]);
+    slow_path(a, ip, op, pushed);
+    land(a, done);
+}
+
+static void push_local(assembler *a, int slot) {
+    load(a, RAX, SLOTS, slot * (int32_t)sizeof(Val));
+    push_rax(a);
+}
+
+static void push_value(assembler *a, Val value) {
+    mov_imm(a, RAX, value);
+    push_rax(a);
+}
+
+static int short_operand(uint8_t *ip) {
+    return (ip[1] << 8) | ip[2];
+}
+
+static int long_operand(uint8_t *ip) {
+    return (ip[1] << 16) | (ip[2] << 8) | ip[3];
+}
+
+/* bytes of the instruction at offset, 0 for an op without a template */
+static int instruction_length(Chunk *chunk, int offset) {
+    switch(chunk->code[offset]) {
+        case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_POP:
+        case OP_EQUAL: case OP_GREATER: case OP_LESS:
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+        case OP_NOT: case OP_NEGATE: case OP_PRINT:
+        case OP_CLOSE_UPVALUE: case OP_RETURN:
+        case OP_ADD_NUM: case OP_ADD_STR: case OP_GREATER_NUM: case OP_LESS_NUM:
+            return 1;
+        case OP_CONSTANT: case OP_GET_LOCAL: case OP_SET_LOCAL:
+        case OP_GET_UPVALUE: case OP_SET_UPVALUE:
+        case OP_CALL: case OP_TAIL_CALL: case OP_SET_LOCAL_POP:
+            return 2;
+        case OP_GET_GLOBAL: case OP_SET_GLOBAL: case OP_DEF_GLOBAL:
+        case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_LOOP: case OP_LOOP_TRACE:
+        case OP_ADD_LOCALS: case OP_ADD_LOCAL_CONST: case OP_LESS_LOCAL_CONST:
+        case OP_GET_LOCAL_LONG: case OP_SET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG: case OP_SET_UPVALUE_LONG:
+            return 3;
+        case OP_CONSTANT_LONG:
+            return 4;
+        case OP_CLOSURE: {
+            obj_function *function =
+                AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->up_count;
+        }
+        case OP_CLOSURE_LONG: {
+            obj_function *function =
+                AS_FUNCTION(chunk->constants.values[long_operand(chunk->code + offset)]);
+            return 4 + 3 * function->up_count;
+        }
+        default:
+            return 0;
+    }
+}
+
+static void instruction(assembler *a, int offset) {
+    uint8_t *ip = a->chunk->code + offset;
+    Val *constants = a->chunk->constants.values;
+    switch(*ip) {
+        case OP_CONSTANT: push_value(a, constants[ip[1]]); break;
+        case OP_CONSTANT_LONG: push_value(a, constants[long_operand(ip)]); break;
+        case OP_NIL:      push_value(a, NIL_VAL); break;
+        case OP_TRUE:     push_value(a, TRUE_VAL); break;
+        case OP_FALSE:    push_value(a, FALSE_VAL); break;
+        case OP_POP:
+            add_imm(a, SP, -(int32_t)sizeof(Val));
+            break;
+        case OP_GET_LOCAL:
+            push_local(a, ip[1]);
+            break;
+        case OP_GET_LOCAL_LONG:
+            push_local(a, short_operand(ip));
+            break;
+        case OP_SET_LOCAL:
+            load(a, RAX, SP, -(int32_t)sizeof(Val));
+            store(a, SLOTS, ip[1] * (int32_t)sizeof(Val), RAX);
+            break;
+        case OP_SET_LOCAL_LONG:
+            load(a, RAX, SP, -(int32_t)sizeof(Val));
+            store(a, SLOTS, short_operand(ip) * (int32_t)sizeof(Val), RAX);
+            break;
+        case OP_SET_LOCAL_POP:
+            add_imm(a, SP, -(int32_t)sizeof(Val));
+            load(a, RAX, SP, 0);
+            store(a, SLOTS, ip[1] * (int32_t)sizeof(Val), RAX);
+            break;
+        case OP_GET_GLOBAL: {
+            /* the array moves as globals are added, load it each time */
+            mov_imm(a, RAX, (uint64_t)(uintptr_t)&vm.global_values.values);
+            load(a, RAX, RAX, 0);
+            load(a, RAX, RAX, short_operand(ip) * (int32_t)sizeof(Val));
+            mov_imm(a, RCX, UNDEFINED_VAL);
+            CMP(a, RAX, RCX);
+            int defined = jump(a, CC_NE);
+            exit_at(a, ip, 0);
+            land(a, defined);
+            push_rax(a);
+            break;
+        }
+        case OP_GET_UPVALUE: case OP_GET_UPVALUE_LONG: {
+            int slot = *ip == OP_GET_UPVALUE ? ip[1] : short_operand(ip);
+            load(a, RAX, FRAME, offsetof(call_frame, closure));
+            load(a, RAX, RAX, offsetof(obj_closure, upvalues) + slot * sizeof(obj_upvalue*));
+            load(a, RAX, RAX, offsetof(obj_upvalue, location));
+            load(a, RAX, RAX, 0);
+            push_rax(a);
+            break;
+        }
+        case OP_JUMP:
+            jump_chunk(a, ALWAYS, offset + 3 + short_operand(ip));
+            break;
+        case OP_LOOP: case OP_LOOP_TRACE:
+            jump_chunk(a, ALWAYS, offset + 3 - short_operand(ip));
+            break;
+        case OP_JUMP_IF_FALSE: {
+            int target = offset + 3 + short_operand(ip);
+            load(a, RAX, SP, -(int32_t)sizeof(Val));
+            mov_imm(a, RCX, NIL_VAL);
+            CMP(a, RAX, RCX);
+            jump_chunk(a, CC_E, target);
+            mov_imm(a, RCX, FALSE_VAL);
+            CMP(a, RAX, RCX);
+            jump_chunk(a, CC_E, target);
+            break;
+        }
+        case OP_ADD: case OP_ADD_NUM: case OP_ADD_STR:
+            arith(a, ip, OP_ADD, 0);
+            break;
+        case OP_SUBTRACT: case OP_MULTIPLY:
+            arith(a, ip, *ip, 0);
+            break;
+        case OP_LESS: case OP_LESS_NUM:
+            compare(a, ip, OP_LESS, 0);
+            break;
+        case OP_GREATER: case OP_GREATER_NUM:
+            compare(a, ip, OP_GREATER, 0);
+            break;
+        case OP_ADD_LOCALS:
+            push_local(a, ip[1]);
+            push_local(a, ip[2]);
+            arith(a, ip, OP_ADD, 2);
+            break;
+        case OP_ADD_LOCAL_CONST:
+            push_local(a, ip[1]);
+            push_value(a, constants[ip[2]]);
+            arith(a, ip, OP_ADD, 2);
+            break;
+        case OP_LESS_LOCAL_CONST:
+            push_local(a, ip[1]);
+            push_value(a, constants[ip[2]]);
+            compare(a, ip, OP_LESS, 2);
+            break;
+        case OP_EQUAL: case OP_DIVIDE: case OP_NOT: case OP_NEGATE:
+        case OP_PRINT: case OP_DEF_GLOBAL: case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE: case OP_SET_UPVALUE_LONG: case OP_CLOSE_UPVALUE:
+        case OP_CLOSURE: case OP_CLOSURE_LONG:
+            slow_path(a, ip, *ip, 0);
+            break;
+        default:
+            /* calls, tail calls and returns belong to run() */
+            exit_at(a, ip, 0);
+            break;
+    }
+}
+
+/* the assembled code in executable memory of its own, NULL if there is none */
+static uint8_t *map_code(assembler *a) {
+    void *code = mmap(NULL, a->count, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED)
+        return NULL;
+    memcpy(code, a->code, a->count);
+    if(mprotect(code, a->count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, a->count);
+        return NULL;
+    }
+    return code;
+}
+
+jit_code *jit_compile(Chunk *chunk) {
+    assembler a = {0};
+    a.chunk = chunk;
+    a.entries = malloc(sizeof(int) * chunk->count);
+    if(a.entries == NULL)
+        return NULL;
+    for(int i = 0; i < chunk->count; i++)
+        a.entries[i] = -1;
+
+    /* entry(sp, frame, target): save what the code keeps its state in,
+     * load the state and jump to the target instruction */
+    push_reg(&a, SP);
+    push_reg(&a, SLOTS);
+    push_reg(&a, FRAME);
+    MOV(&a, SP, RDI);
+    MOV(&a, FRAME, RSI);
+    load(&a, SLOTS, RSI, offsetof(call_frame, slots));
+    byte(&a, 0xff); byte(&a, 0xe2); // jmp rdx
+
+    /* every exit returns the stack top */
+    a.exit = a.count;
+    MOV(&a, RAX, SP);
+    pop_reg(&a, FRAME);
+    pop_reg(&a, SLOTS);
+    pop_reg(&a, SP);
+    byte(&a, 0xc3);                 // ret
+
+    bool failed = false;
+    for(int offset = 0; offset < chunk->count;) {
+        int length = instruction_length(chunk, offset);
+        if(length == 0) {
+            failed = true;
+            break;
+        }
+        a.entries[offset] = a.count;
+        instruction(&a, offset);
+        offset += length;
+    }
+    for(int i = 0; i < a.patch_count && !failed; i++)
+        patch(&a, a.patches[i].at, a.entries[a.patches[i].target]);
+    free(a.patches);
+
+    uint8_t *code = failed ? NULL : map_code(&a);
+    free(a.code);
+    if(code == NULL) {
+        free(a.entries);
+        return NULL;
+    }
+
+    jit_code *jit = ALLOCATE(jit_code, 1);
+    jit->code = code;
+    jit->size = a.count;
+    jit->count = chunk->count;
+    jit->entries = ALLOCATE(int, chunk->count);
+    memcpy(jit->entries, a.entries, sizeof(int) * chunk->count);
+    free(a.entries);
+    return jit;
+}
+
+void free_jit(jit_code *code) {
+    munmap(code->code, code->size);
+    FREE_ARRAY(int, code->entries, code->count);
+    FREE_ARRAY(jit_code, code, 1);
+}
+
+size_t jit_size(jit_code *code) {
+    return sizeof(jit_code) + code->size + sizeof(int) * code->count;
+}
+
+typedef Val *(*jit_entry)(Val *sp, call_frame *frame, uint8_t *target);
+
+Val *jit_run(jit_code *code, call_frame *frame, Val *sp) {
+    int offset = (int)(frame->ip - frame->closure->function->chunk.code);
+    return ((jit_entry)code->code)(sp, frame, code->code + code->entries[offset]);
+}
+
+#ifdef TRACE_JIT
+
+/* a trace keeps the globals array in a register of its own, and
+ * counts the iterations it finishes in another. each instruction's
+ * result has 8 bytes on the machine stack, unboxed */
+#define GLOBALS    R15
+#define ITERATIONS R14
+
+#define XMM0 0
+#define XMM1 1
+
+/* prefix 0x0f op with xmm in ModRM reg, wide for a 64 bit register in rm */
+static void sse(assembler *a, uint8_t prefix, bool wide, uint8_t op, int xmm, int rm) {
+    byte(a, prefix);
+    if(wide)
+        rex(a, xmm, rm);
+    byte(a, 0x0f);
+    byte(a, op);
+    byte(a, 0xc0 | ((xmm & 7) << 3) | (rm & 7));
+}
+
+#define MOVQ_TO_XMM(a, xmm, reg)   sse(a, 0x66, true, 0x6e, xmm, reg)
+#define MOVQ_FROM_XMM(a, reg, xmm) sse(a, 0x66, true, 0x7e, xmm, reg)
+#define CVTSI2SD(a, xmm, reg)      sse(a, 0xf2, true, 0x2a, xmm, reg)
+#define UCOMISD(a, x, y)           sse(a, 0x66, false, 0x2e, x, y)
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5c
+#define DIVSD 0x5e
+
+/* byte offset of a slot, a global or a spilled result */
+static int32_t cell(int index) {
+    return index * (int32_t)sizeof(Val);
+}
+
+/* the exits jump through the chunk jump patches, with entries holding
+ * the stub of each snapshot */
+static void jump_exit(assembler *a, int cc, int exit) {
+    jump_chunk(a, cc, exit);
+}
+
+static uint64_t unboxed(ir_inst *inst) {
+    switch(inst->type) {
+        case TYPE_INT:  return (uint64_t)AS_INT(inst->value);
+        case TYPE_NUM:  return inst->value;
+        case TYPE_BOOL: return AS_BOOL(inst->value);
+        default:        return 0;
+    }
+}
+
+/* reg = the unboxed result of ref */
+static void operand(assembler *a, trace_recording *rec, int reg, int ref) {
+    if(rec->ir[ref].op == IR_CONST)
+        mov_imm(a, reg, unboxed(&rec->ir[ref]));
+    else
+        load(a, reg, RSP, cell(ref));
+}
+
+/* xmm = ref as a double, through rax */
+static void double_operand(assembler *a, trace_recording *rec, int xmm, int ref) {
+    operand(a, rec, RAX, ref);
+    if(rec->ir[ref].type == TYPE_INT)
+        CVTSI2SD(a, xmm, RAX);
+    else
+        MOVQ_TO_XMM(a, xmm, RAX);
+}
+
+/* rax = ref boxed into a Val */
+static void box(assembler *a, trace_recording *rec, int ref) {
+    ir_inst *inst = &rec->ir[ref];
+    if(inst->op == IR_CONST) {
+        mov_imm(a, RAX, inst->value);
+        return;
+    }
+    switch(inst->type) {
+        case TYPE_INT:
+            load(a, RAX, RSP, cell(ref));
+            shift(a, SHL, RAX, 16);
+            shift(a, SHR, RAX, 16);
+            mov_imm(a, RCX, QNAN | INT_TAG);
+            OR(a, RAX, RCX);
+            break;
+        case TYPE_NUM:
+            load(a, RAX, RSP, cell(ref));
+            break;
+        case TYPE_BOOL:
+            load(a, RAX, RSP, cell(ref));
+            mov_imm(a, RCX, FALSE_VAL);
+            ADD(a, RAX, RCX);
+            break;
+        default:
+            mov_imm(a, RAX, NIL_VAL);
+            break;
+    }
+}
+
+/* leave unless the Val in rax has the type, then unbox it in place */
+static void unbox(assembler *a, int type, int exit) {
+    switch(type) {
+        case TYPE_INT:
+            MOV(a, RDX, RAX);
+            shift(a, SHR, RDX, 48);
+            cmp32_imm(a, RDX, INT_TOP);
+            jump_exit(a, CC_NE, exit);
+            shift(a, SHL, RAX, 16);
+            shift(a, SAR, RAX, 16);
+            break;
+        case TYPE_NUM:
+            mov_imm(a, RCX, QNAN);
+            MOV(a, RDX, RAX);
+            AND(a, RDX, RCX);
+            CMP(a, RDX, RCX);
+            jump_exit(a, CC_E, exit);
+            break;
+        case TYPE_BOOL:
+            /* false and true become 0 and 1, anything else is above */
+            mov_imm(a, RCX, FALSE_VAL);
+            SUB(a, RAX, RCX);
+            MOV(a, RDX, RAX);
+            shift(a, SHR, RDX, 1);
+            TEST(a, RDX, RDX);
+            jump_exit(a, CC_NE, exit);
+            break;
+        default:
+            mov_imm(a, RCX, NIL_VAL);
+            CMP(a, RAX, RCX);
+            jump_exit(a, CC_NE, exit);
+            break;
+    }
+}
+
+/* ints are shifted to the top 48 bits to overflow where the Val would */
+static void int_arith(assembler *a, trace_recording *rec, ir_inst *inst) {
+    operand(a, rec, RAX, inst->a);
+    operand(a, rec, RCX, inst->b);
+    switch(inst->op) {
+        case IR_ADD:
+        case IR_SUBTRACT:
+            shift(a, SHL, RAX, 16);
+            shift(a, SHL, RCX, 16);
+            if(inst->op == IR_ADD)
+                ADD(a, RAX, RCX);
+            else
+                SUB(a, RAX, RCX);
+            jump_exit(a, CC_O, inst->exit);
+            shift(a, SAR, RAX, 16);
+            break;
+        case IR_MULTIPLY:
+            shift(a, SHL, RAX, 16);
+            imul(a, RAX, RCX);
+            jump_exit(a, CC_O, inst->exit);
+            shift(a, SAR, RAX, 16);
+            break;
+        case IR_DIVIDE:
+            /* only exact divisions stay ints, the rest are run() again */
+            TEST(a, RCX, RCX);
+            jump_exit(a, CC_E, inst->exit);
+            mov_imm(a, RDX, (uint64_t)-1);
+            CMP(a, RCX, RDX);
+            jump_exit(a, CC_E, inst->exit);
+            byte(a, 0x48); byte(a, 0x99);             // cqo
+            byte(a, 0x48); byte(a, 0xf7); byte(a, 0xf9); // idiv rcx
+            TEST(a, RDX, RDX);
+            jump_exit(a, CC_NE, inst->exit);
+            break;
+    }
+}
+
+static void double_arith(assembler *a, trace_recording *rec, ir_inst *inst) {
+    double_operand(a, rec, XMM0, inst->a);
+    double_operand(a, rec, XMM1, inst->b);
+    uint8_t op = inst->op == IR_ADD      ? ADDSD
+               : inst->op == IR_SUBTRACT ? SUBSD
+               : inst->op == IR_MULTIPLY ? MULSD
+               : DIVSD;
+    sse(a, 0xf2, false, op, XMM0, XMM1);
+    MOVQ_FROM_XMM(a, RAX, XMM0);
+}
+
+/* ints and bools compare as they are, anything with a double in it as
+ * doubles. unordered leaves above, equal and parity clear */
+static void trace_compare(assembler *a, trace_recording *rec, ir_inst *inst) {
+    uint8_t x = rec->ir[inst->a].type;
+    uint8_t y = rec->ir[inst->b].type;
+    if(x == y && x != TYPE_NUM) {
+        operand(a, rec, RAX, inst->a);
+        operand(a, rec, RCX, inst->b);
+        CMP(a, RAX, RCX);
+        set_flag(a, inst->op == IR_LESS ? CC_L : inst->op == IR_GREATER ? CC_G : CC_E);
+        return;
+    }
+    double_operand(a, rec, XMM0, inst->a);
+    double_operand(a, rec, XMM1, inst->b);
+    switch(inst->op) {
+        case IR_LESS:
+            UCOMISD(a, XMM1, XMM0);
+            set_flag(a, CC_A);
+            break;
+        case IR_GREATER:
+            UCOMISD(a, XMM0, XMM1);
+            set_flag(a, CC_A);
+            break;
+        default:
+            UCOMISD(a, XMM0, XMM1);
+            byte(a, 0x0f); byte(a, 0x9b); byte(a, 0xc1); // setnp cl
+            set_flag(a, CC_E);
+            byte(a, 0x20); byte(a, 0xc8);                // and al, cl
+            break;
+    }
+}
+
+static void trace_instruction(assembler *a, trace_recording *rec, int ref) {
+    ir_inst *inst = &rec->ir[ref];
+    switch(inst->op) {
+        case IR_CONST:
+            return;
+        case IR_LOAD_SLOT:
+            load(a, RAX, SLOTS, cell(inst->a));
+            unbox(a, inst->type, inst->exit);
+            break;
+        case IR_LOAD_GLOBAL:
+            load(a, RAX, GLOBALS, cell(inst->a));
+            unbox(a, inst->type, inst->exit);
+            break;
+        case IR_CHECK_GLOBAL:
+            load(a, RAX, GLOBALS, cell(inst->a));
+            mov_imm(a, RCX, UNDEFINED_VAL);
+            CMP(a, RAX, RCX);
+            jump_exit(a, CC_E, inst->exit);
+            return;
+        case IR_STORE_SLOT:
+            box(a, rec, inst->b);
+            store(a, SLOTS, cell(inst->a), RAX);
+            return;
+        case IR_STORE_GLOBAL:
+            /* only numbers, bools and nil, which the collector ignores */
+            box(a, rec, inst->b);
+            store(a, GLOBALS, cell(inst->a), RAX);
+            return;
+        case IR_ADD: case IR_SUBTRACT: case IR_MULTIPLY: case IR_DIVIDE:
+            if(inst->type == TYPE_INT)
+                int_arith(a, rec, inst);
+            else
+                double_arith(a, rec, inst);
+            break;
+        case IR_NEGATE:
+            operand(a, rec, RAX, inst->a);
+            if(inst->type == TYPE_INT) {
+                shift(a, SHL, RAX, 16);
+                byte(a, 0x48); byte(a, 0xf7); byte(a, 0xd8); // neg rax
+                jump_exit(a, CC_O, inst->exit);
+                shift(a, SAR, RAX, 16);
+            }
+            else {
+                mov_imm(a, RCX, SIGN_BIT);
+                XOR(a, RAX, RCX);
+            }
+            break;
+        case IR_NOT:
+            operand(a, rec, RAX, inst->a);
+            mov_imm(a, RCX, 1);
+            XOR(a, RAX, RCX);
+            break;
+        case IR_LESS: case IR_GREATER: case IR_EQUAL:
+            trace_compare(a, rec, inst);
+            break;
+        case IR_GUARD_TRUE: case IR_GUARD_FALSE:
+            operand(a, rec, RAX, inst->a);
+            TEST(a, RAX, RAX);
+            jump_exit(a, inst->op == IR_GUARD_TRUE ? CC_E : CC_NE, inst->exit);
+            return;
+    }
+    store(a, RSP, cell(ref), RAX);
+}
+
+/* box what the snapshot keeps above the loop's base into the stack and
+ * hand run() the stack top and the op to resume at */
+static void exit_stub(assembler *a, trace_recording *rec, snapshot *snap, int leave) {
+    for(int i = 0; i < snap->depth - rec->base; i++) {
+        box(a, rec, rec->refs[snap->refs + i]);
+        store(a, SLOTS, cell(rec->base + i), RAX);
+    }
+    mov_imm(a, RCX, (uint64_t)(uintptr_t)snap->pc);
+    store(a, FRAME, offsetof(call_frame, ip), RCX);
+    MOV(a, RAX, SLOTS);
+    add_imm(a, RAX, cell(snap->depth));
+    jump_to(a, ALWAYS, leave);
+}
+
+bool compile_trace(loop_trace *trace, trace_recording *rec) {
+    assembler a = {0};
+    a.entries = malloc(sizeof(int) * (rec->snapshot_count + 1));
+    if(a.entries == NULL)
+        return false;
+    /* the spilled results, 16 byte aligned */
+    int32_t frame_size = (cell(rec->count) + 15) & ~15;
+
+    /* entry(slots, frame) */
+    push_reg(&a, SP);
+    push_reg(&a, SLOTS);
+    push_reg(&a, FRAME);
+    push_reg(&a, ITERATIONS);
+    push_reg(&a, GLOBALS);
+    add_imm(&a, RSP, -frame_size);
+    MOV(&a, SLOTS, RDI);
+    MOV(&a, FRAME, RSI);
+    mov_imm(&a, ITERATIONS, 0);
+    /* nothing in a trace defines a global, the array stays put */
+    mov_imm(&a, GLOBALS, (uint64_t)(uintptr_t)&vm.global_values.values);
+    load(&a, GLOBALS, GLOBALS, 0);
+
+    int loop = a.count;
+    for(int i = 0; i < rec->count; i++)
+        trace_instruction(&a, rec, i);
+    add_imm(&a, ITERATIONS, 1);
+    jump_to(&a, ALWAYS, loop);
+
+    /* every exit ends here, with the stack top in rax */
+    int leave = a.count;
+    mov_imm(&a, RCX, (uint64_t)(uintptr_t)&trace->iterations);
+    store(&a, RCX, 0, ITERATIONS);
+    add_imm(&a, RSP, frame_size);
+    pop_reg(&a, GLOBALS);
+    pop_reg(&a, ITERATIONS);
+    pop_reg(&a, FRAME);
+    pop_reg(&a, SLOTS);
+    pop_reg(&a, SP);
+    byte(&a, 0xc3);                 // ret
+
+    for(int i = 0; i < rec->snapshot_count; i++) {
+        a.entries[i] = a.count;
+        exit_stub(&a, rec, &rec->snapshots[i], leave);
+    }
+    for(int i = 0; i < a.patch_count; i++)
+        patch(&a, a.patches[i].at, a.entries[a.patches[i].target]);
+    free(a.patches);
+    free(a.entries);
+
+    uint8_t *code = map_code(&a);
+    free(a.code);
+    if(code == NULL)
+        return false;
+    trace->code = code;
+    trace->size = a.count;
+    return true;
+}
+
+void discard_trace(loop_trace *trace) {
+    if(trace->code != NULL)
+        munmap(trace->code, trace->size);
+    trace->code = NULL;
+    trace->size = 0;
+}
+
+void free_traces(loop_trace *trace) {
+    while(trace != NULL) {
+        loop_trace *next = trace->next;
+        discard_trace(trace);
+        FREE_ARRAY(loop_trace, trace, 1);
+        trace = next;
+    }
+}
+
+size_t traces_size(loop_trace *trace) {
+    size_t size = 0;
+    for(; trace != NULL; trace = trace->next)
+        size += sizeof(loop_trace) + (trace->code != NULL ? trace->size : 0);
+    return size;
+}
+
+typedef Val *(*trace_entry)(Val *slots, call_frame *frame);
+
+Val *trace_run(loop_trace *trace, call_frame *frame) {
+    return ((trace_entry)trace->code)(frame->slots, frame);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "chunk.h"
+
+/* functions called often enough are compiled to x86-64 machine code,
+ * one template per opcode. the code works on the interpreter's own
+ * stack and frame, so it can hand back to run() at any instruction:
+ * calls and returns always do, and so does any op that fails, which
+ * run() then executes once more to report the error */
+#define JIT_THRESHOLD 100
+
+typedef struct {
+    /* executable, mapped by the jit itself */
+    uint8_t *code;
+    size_t size;
+    /* offset into code for each offset of the chunk, -1 where no
+     * instruction starts */
+    int *entries;
+    int count;
+} jit_code;
+
+struct call_frame;
+struct trace_recording;
+
+/* back edges a loop takes before its next iteration is recorded */
+#define TRACE_THRESHOLD 64
+/* failed recordings or recompilations before a loop is left alone */
+#define TRACE_ATTEMPTS 4
+/* runs in a row that leave before finishing an iteration, after which
+ * a trace is thrown away to be recorded again */
+#define TRACE_MISSES 16
+
+/* a hot loop of a function, keyed by the chunk offset of its header */
+typedef struct loop_trace {
+    int header;
+    /* executable, NULL while there is no trace to run */
+    uint8_t *code;
+    size_t size;
+    int attempts;
+    int misses;
+    /* iterations the last run finished, the code writes it on leaving */
+    uint64_t iterations;
+    struct loop_trace *next;
+} loop_trace;
+
+/* NULL for a chunk with an op the templates don't know */
+jit_code *jit_compile(Chunk *chunk);
+void free_jit(jit_code *code);
+size_t jit_size(jit_code *code);
+/* run frame's code from frame->ip with the stack ending at sp. returns
+ * the stack top once it hands back, frame->ip is the op to run next */
+Val *jit_run(jit_code *code, struct call_frame *frame, Val *sp);
+
+/* compile a recording into trace, false if it can't be */
+bool compile_trace(loop_trace *trace, struct trace_recording *recording);
+/* free the code of trace, leaving it without any */
+void discard_trace(loop_trace *trace);
+void free_traces(loop_trace *trace);
+size_t traces_size(loop_trace *trace);
+/* run trace from the loop header frame->ip is at. returns the stack top
+ * once a check fails, frame->ip is the op to run next */
+Val *trace_run(loop_trace *trace, struct call_frame *frame);
+
+/* the ops the templates and code compiled ahead of time call out for,
+ * defined by the vm. the new stack top, or NULL when run() has to
+ * report an error for the op at ip */
+Val *jit_slow_path(Val *sp, struct call_frame *frame, uint8_t *ip, uint8_t op);
+
+#endif
@@ -3,8 +3,11 @@
 #include <string.h>
 
 #include "common.h"
+#include "aot.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
 
@@ -73,20 +76,137 @@ static void run_file(const char *path){
     }
 }
 
+/* compile the script at path without running it and write it out as C */
+static void emit_file(const char *path, const char *out_path) {
+    char *source = read_file(path);
+    obj_function *function = compile(source);
+    free(source);
+    if(function == NULL) {
+        printf("COMPILE ERROR\n");
+        exit(65);
+    }
+
+    FILE *out = fopen(out_path, "w");
+    if(out == NULL) {
+        fprintf(stderr, "Could not open \"%s\".\n", out_path);
+        exit(74);
+    }
+    bool written = emit_c(function, out);
+    if(fclose(out) != 0 || !written) {
+        fprintf(stderr, "Could not write \"%s\".\n", out_path);
+        exit(74);
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "USAGE: ./cpplox [options] [path]\n");
+    fprintf(stderr, "  --gc=incremental     split full collections into bounded steps\n");
+    fprintf(stderr, "  --gc=concurrent      mark on a helper thread, sweep in bounded steps\n");
+    fprintf(stderr, "  --gc=stop-the-world  collect in one pause (default)\n");
+    fprintf(stderr, "  --gc-budget=N        objects traced or swept per incremental step\n");
+    fprintf(stderr, "  --gc-stats           print the collector pause histogram on exit\n");
+    fprintf(stderr, "  --max-heap=SIZE      fail scripts whose heap outgrows SIZE (k, m, g)\n");
+    fprintf(stderr, "  --max-frames=N       fail scripts whose calls nest deeper than N\n");
+    fprintf(stderr, "  --max-stack=SIZE     fail scripts whose value stack outgrows SIZE (k, m, g)\n");
+    fprintf(stderr, "  --jit-threshold=N    compile functions to machine code after N calls, 0 never\n");
+    fprintf(stderr, "  --trace-threshold=N  compile loops to machine code after N iterations, 0 never\n");
+    fprintf(stderr, "  --emit-c=FILE        write the script to FILE as C instead of running it\n");
+    exit(64);
+}
+
+/* a byte count with an optional k, m or g suffix, 0 if malformed */
+static size_t parse_size(const char *text) {
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+    if(end == text)
+        return 0;
+    switch(*end) {
+        case 'k': case 'K': size <<= 10; end++; break;
+        case 'm': case 'M': size <<= 20; end++; break;
+        case 'g': case 'G': size <<= 30; end++; break;
+    }
+    return *end == '\0' ? (size_t)size : 0;
+}
 
 int main (int argc, const char *argv[]) {
 
     init_vm();
+
+    const char *path = NULL;
+    const char *emit_path = NULL;
+    for(int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if(!strcmp(arg, "--gc=incremental")) {
+            vm.gc_incremental = true;
+            vm.gc_concurrent = false;
+        }
+        else if(!strcmp(arg, "--gc=concurrent")) {
+            vm.gc_incremental = true;
+            vm.gc_concurrent = true;
+        }
+        else if(!strcmp(arg, "--gc=stop-the-world")) {
+            vm.gc_incremental = false;
+            vm.gc_concurrent = false;
+        }
+        else if(!strncmp(arg, "--gc-budget=", 12)) {
+            vm.gc_step_budget = atoi(arg + 12);
+            if(vm.gc_step_budget <= 0)
+                usage();
+        }
+        else if(!strncmp(arg, "--max-heap=", 11)) {
+            vm.max_heap = parse_size(arg + 11);
+            if(vm.max_heap == 0)
+                usage();
+        }
+        else if(!strncmp(arg, "--max-frames=", 13)) {
+            vm.max_frames = atoi(arg + 13);
+            if(vm.max_frames <= 0)
+                usage();
+        }
+        else if(!strncmp(arg, "--max-stack=", 12)) {
+            vm.max_stack = parse_size(arg + 12);
+            if(vm.max_stack == 0)
+                usage();
+        }
+        else if(!strncmp(arg, "--jit-threshold=", 16)) {
+            char *end;
+            vm.jit_threshold = (uint32_t)strtoul(arg + 16, &end, 10);
+            if(end == arg + 16 || *end != '\0')
+                usage();
+        }
+        else if(!strncmp(arg, "--trace-threshold=", 18)) {
+            char *end;
+            vm.trace_threshold = (uint32_t)strtoul(arg + 18, &end, 10);
+            if(end == arg + 18 || *end != '\0')
+                usage();
+        }
+        else if(!strncmp(arg, "--emit-c=", 9)) {
+            emit_path = arg + 9;
+            if(*emit_path == '\0')
+                usage();
+        }
+        else if(!strcmp(arg, "--gc-stats")) {
+            atexit(print_gc_stats);
+        }
+        else if(arg[0] == '-' || path != NULL) {
+            usage();
+        }
+        else {
+            path = arg;
+        }
+    }
+
     //REPL
-    if(argc == 1) {
-        repl();
+    if(emit_path != NULL) {
+        if(path == NULL)
+            usage();
+        emit_file(path, emit_path);
     }
-    else if (argc == 2) {
-        run_file(argv[1]);
+    else if(path == NULL) {
+        repl();
     }
     else {
-        fprintf(stderr, "USAGE: ./cpplox [path]\n");
-        exit(64);
+        run_file(path);
     }
 
     free_vm();
@@ -1,33 +1,526 @@
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+/* after a collection, let the heap grow to twice the surviving size */
+#define GC_HEAP_GROW_FACTOR 2
+/* bytes of new objects between two minor collections */
+#define NURSERY_SIZE (256 * 1024)
+/* bytes allocated between two steps of an incremental cycle */
+#define GC_STEP_SIZE (8 * 1024)
+
+/* true while a minor collection is running, old objects count as live */
+static bool minor_cycle = false;
+/* the collector itself allocates when it shrinks the intern table */
+static bool collecting = false;
+
+/* the link the incremental sweep continues from */
+static Obj **sweep_link = NULL;
+/* the nursery as it was when marking ended, swept before the old generation */
+static Obj *young_sweep = NULL;
+/* progress of the incremental pass over the intern table */
+static int weak_cursor = 0;
+static entry *weak_entries = NULL;
+/* progress of the incremental pass over the global tables, which an
+ * incremental cycle scans before it traces */
+static int name_cursor = 0;
+static int value_cursor = 0;
+static bool globals_marked = false;
+
+static bool is_marking() {
+    return vm.gc_state == GC_MARK || vm.gc_state == GC_WEAK;
+}
+
+/* concurrent marking. the helper thread only ever touches the gray
+ * stack and the fields of the objects it blackens, it never looks at
+ * the value stack or the tables. while it runs, every store into such
+ * a field and every push to the gray stack happens under gc_mutex
+ * */
+#define MARKER_BATCH 64
+
+static pthread_mutex_t gc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t marker;
+/* only touched by the interpreter thread */
+static bool marker_running = false;
+/* guarded by gc_mutex */
+static bool marker_done = false;
+static bool marker_stop = false;
+
+static bool trace_references(int budget);
+
+static void collect_young();
+static void start_cycle();
+
+/* each slab is one malloc() carved into equally sized slots */
+#define SLAB_SIZE (16 * 1024)
+
+/* a free slot stores the link to the next free slot in itself */
+typedef struct pool_slot {
+    struct pool_slot *next;
+} pool_slot;
+
+typedef struct slab {
+    struct slab *next;
+} slab;
+
+typedef struct {
+    pool_slot *free_list;
+    slab *slabs;
+    pool_stats stats;
+} object_pool;
+
+static object_pool pools[POOL_CLASSES];
+
+/* called right before the heap grows by size bytes */
+static void collect_if_needed(size_t size) {
+  if (collecting)
+    return;
+  vm.gc_step_debt += size;
+#ifdef DEBUG_STRESS_GC
+  static int stress_count = 0;
+  if (vm.gc_incremental) {
+    if (vm.gc_state == GC_IDLE)
+      start_cycle();
+    else if (vm.gc_state == GC_SWEEP && young_sweep == NULL &&
+             ++stress_count % 2 == 0)
+      collect_young();
+    else
+      gc_step();
+    return;
+  }
+  if (++stress_count % 16 == 0)
+    collect_garbage();
+  else
+    collect_young();
+#endif
+  if (vm.gc_state != GC_IDLE) {
+    /* a full cycle is in progress, pay it off a step at a time. the
+     * nursery can only be collected on its own again once the cycle
+     * is down to sweeping the old generation */
+    if (vm.gc_step_debt > GC_STEP_SIZE)
+      gc_step();
+    else if (vm.gc_state == GC_SWEEP && young_sweep == NULL &&
+             vm.young_bytes > NURSERY_SIZE)
+      collect_young();
+    return;
+  }
+
+  if (vm.bytes_allocated > vm.next_gc) {
+    if (vm.gc_incremental)
+      start_cycle();
+    else
+      collect_garbage();
+  } else if (vm.young_bytes > NURSERY_SIZE) {
+    collect_young();
+  }
+}
+
+/* the heap can't grow by size more bytes. unwind to interpret(),
+ * which reports it as a runtime error. inside the collector or outside
+ * of interpret() there is nothing sensible to unwind to
+ * */
+static void out_of_memory(size_t size) {
+  vm.bytes_allocated -= size;
+  if (collecting || vm.oom_handler == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  longjmp(*vm.oom_handler, 1);
+}
+
+static bool over_budget() {
+  return vm.max_heap != 0 && vm.bytes_allocated > vm.max_heap;
+}
+
+/* called once bytes_allocated accounts for size more bytes that are
+ * about to be handed out. a full collection is the last resort before
+ * giving up on them */
+static void ensure_heap(size_t size) {
+  collect_if_needed(size);
+  if (over_budget() && !collecting) {
+    collect_garbage();
+    if (over_budget())
+      out_of_memory(size);
+  }
+}
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  vm.bytes_allocated += newSize - oldSize;
+  if (newSize > oldSize)
+    ensure_heap(newSize - oldSize);
+
   if (newSize == 0) {
     free(pointer);
     return NULL;
   }
   // Free the memory allocation when the size reduces to 0
   void *result = realloc(pointer, newSize); // Works like malloc when oldSize = 0
-  
+  if (result == NULL && !collecting) {
+    collect_garbage();
+    result = realloc(pointer, newSize);
+  }
   if (result == NULL)
-    exit(1); // Memory overflow
+    out_of_memory(newSize - oldSize);
   return result;
 }
 
+static int size_class(size_t size) {
+    return (int)((size + POOL_GRANULE - 1) / POOL_GRANULE) - 1;
+}
+
+static bool grow_pool(object_pool *pool) {
+    slab *block = (slab*)malloc(SLAB_SIZE);
+    if(block == NULL)
+        return false;
+    block->next = pool->slabs;
+    pool->slabs = block;
+    pool->stats.slabs++;
+
+    /* the header takes one granule so every slot stays 16 byte aligned.
+     * thread the slots back to front, consecutive allocations then
+     * land next to each other in memory
+     * */
+    size_t slot_size = pool->stats.slot_size;
+    char *start = (char*)block + POOL_GRANULE;
+    int count = (int)((SLAB_SIZE - POOL_GRANULE) / slot_size);
+    for(int i = count - 1; i >= 0; i--) {
+        pool_slot *slot = (pool_slot*)(start + i * slot_size);
+        slot->next = pool->free_list;
+        pool->free_list = slot;
+    }
+    return true;
+}
+
+/* the bytes an allocation of size really takes, a whole slot for the
+ * pooled sizes */
+size_t pooled_size(size_t size) {
+    if(size > POOL_MAX_SIZE)
+        return size;
+    return (size_t)(size_class(size) + 1) * POOL_GRANULE;
+}
+
+void *allocate_pooled(size_t size) {
+    if(size > POOL_MAX_SIZE)
+        return reallocate(NULL, 0, size);
+
+    object_pool *pool = &pools[size_class(size)];
+    if(pool->stats.slot_size == 0)
+        pool->stats.slot_size = (size_t)(size_class(size) + 1) * POOL_GRANULE;
+
+    vm.bytes_allocated += pool->stats.slot_size;
+    ensure_heap(pool->stats.slot_size);
+
+    /* the collection above may have refilled the free list */
+    if(pool->free_list == NULL && !grow_pool(pool)) {
+        if(!collecting)
+            collect_garbage();
+        if(pool->free_list == NULL && !grow_pool(pool))
+            out_of_memory(pool->stats.slot_size);
+    }
+
+    pool_slot *slot = pool->free_list;
+    pool->free_list = slot->next;
+    pool->stats.live++;
+    pool->stats.allocations++;
+    return slot;
+}
+
+void free_pooled(void *pointer, size_t size) {
+    if(size > POOL_MAX_SIZE) {
+        reallocate(pointer, size, 0);
+        return;
+    }
+
+    object_pool *pool = &pools[size_class(size)];
+    vm.bytes_allocated -= pool->stats.slot_size;
+#ifdef DEBUG_STRESS_GC
+    /* make stale references to freed objects obvious */
+    memset(pointer, 0xdd, pool->stats.slot_size);
+#endif
+    pool_slot *slot = (pool_slot*)pointer;
+    slot->next = pool->free_list;
+    pool->free_list = slot;
+    pool->stats.live--;
+    pool->stats.frees++;
+}
+
+pool_stats get_pool_stats(int size_class) {
+    pool_stats stats = pools[size_class].stats;
+    stats.slot_size = (size_t)(size_class + 1) * POOL_GRANULE;
+    return stats;
+}
+
+void print_pool_stats() {
+    printf("%-6s %6s %10s %12s %12s\n", "slot", "slabs", "live", "allocs", "frees");
+    for(int i = 0; i < POOL_CLASSES; i++) {
+        pool_stats stats = get_pool_stats(i);
+        if(stats.allocations == 0) continue;
+        printf("%-6zu %6d %10zu %12zu %12zu\n", stats.slot_size, stats.slabs,
+                stats.live, stats.allocations, stats.frees);
+    }
+}
+
+static void free_pools() {
+    for(int i = 0; i < POOL_CLASSES; i++) {
+        slab *block = pools[i].slabs;
+        while(block != NULL) {
+            slab *next = block->next;
+            free(block);
+            block = next;
+        }
+        pools[i].slabs = NULL;
+        pools[i].free_list = NULL;
+    }
+}
+
+void mark_object(Obj *object) {
+    if(object == NULL) return;
+    if(object->is_marked) return;
+    /* a minor collection never traces into the old generation */
+    if(minor_cycle && object->is_old) return;
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    print_val(OBJ_VAL(object));
+    printf("\n");
+#endif
+    object->is_marked = true;
+
+    /* the gray stack is owned by the collector itself, so it
+     * goes straight to the system allocator. growing it through
+     * reallocate() could recursively start another collection.
+     * */
+    if(vm.gray_capacity < vm.gray_count + 1) {
+        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+        vm.gray_stack = (Obj**)realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
+        if(vm.gray_stack == NULL)
+            exit(1);
+    }
+    vm.gray_stack[vm.gray_count++] = object;
+}
+
+void mark_value(Val value) {
+    if(IS_OBJ(value)) mark_object(AS_OBJ(value));
+}
+
+/* unreached by the current collection */
+bool is_white(Obj *object) {
+    if(minor_cycle && object->is_old) return false;
+    return !object->is_marked;
+}
+
+static void remember(Obj *object) {
+    if(object->is_remembered) return;
+    object->is_remembered = true;
+
+    if(vm.remembered_capacity < vm.remembered_count + 1) {
+        vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.remembered_capacity);
+        if(vm.remembered == NULL)
+            exit(1);
+    }
+    vm.remembered[vm.remembered_count++] = object;
+}
+
+void remember_young_string(obj_string *string) {
+    if(vm.young_string_capacity < vm.young_string_count + 1) {
+        vm.young_string_capacity = GROW_CAPACITY(vm.young_string_capacity);
+        vm.young_strings = (obj_string**)realloc(vm.young_strings,
+                sizeof(obj_string*) * vm.young_string_capacity);
+        if(vm.young_strings == NULL)
+            exit(1);
+    }
+    vm.young_strings[vm.young_string_count++] = string;
+}
+
+void gc_lock() {
+    if(marker_running)
+        pthread_mutex_lock(&gc_mutex);
+}
+
+void gc_unlock() {
+    if(marker_running)
+        pthread_mutex_unlock(&gc_mutex);
+}
+
+static void *marker_main(void *arg) {
+    (void)arg;
+    for(;;) {
+        pthread_mutex_lock(&gc_mutex);
+        bool done = marker_stop || trace_references(MARKER_BATCH);
+        marker_done = done;
+        pthread_mutex_unlock(&gc_mutex);
+        if(done) return NULL;
+    }
+}
+
+static void start_marker() {
+    marker_done = false;
+    marker_stop = false;
+    /* without a thread the cycle just carries on incrementally */
+    marker_running = pthread_create(&marker, NULL, marker_main, NULL) == 0;
+}
+
+static bool marker_finished() {
+    pthread_mutex_lock(&gc_mutex);
+    bool done = marker_done;
+    pthread_mutex_unlock(&gc_mutex);
+    return done;
+}
+
+/* wait for the helper thread, with stop set it gives up on the rest
+ * of the gray stack and leaves it to the caller */
+static void join_marker(bool stop) {
+    if(!marker_running) return;
+    if(stop) {
+        pthread_mutex_lock(&gc_mutex);
+        marker_stop = true;
+        pthread_mutex_unlock(&gc_mutex);
+    }
+    pthread_join(marker, NULL);
+    marker_running = false;
+}
+
+/* call after storing value into a field of owner */
+void write_barrier(Obj *owner, Val value) {
+    if(!IS_OBJ(value) || AS_OBJ(value) == NULL) return;
+
+    /* while a cycle is marking, a black object must never end up
+     * pointing at a white one. shade the new target instead */
+    if(is_marking()) {
+        gc_lock();
+        if(owner->is_marked)
+            mark_object(AS_OBJ(value));
+        gc_unlock();
+    }
+
+    /* while sweeping, the marked part of the set aside nursery is
+     * about to be promoted and already counts as old */
+    bool old = owner->is_old || (vm.gc_state == GC_SWEEP && owner->is_marked);
+    if(old && !AS_OBJ(value)->is_old)
+        remember(owner);
+}
+
+/* call after storing value into a root table such as vm.global_values.
+ * the tables are only scanned by full collections, so the nursery
+ * object itself is remembered until it gets promoted, and an
+ * incremental cycle that already scanned the table shades it
+ * */
+void root_write_barrier(Val value) {
+    if(!IS_OBJ(value)) return;
+
+    if(is_marking()) {
+        gc_lock();
+        mark_object(AS_OBJ(value));
+        gc_unlock();
+    }
+
+    if(!AS_OBJ(value)->is_old)
+        remember(AS_OBJ(value));
+}
+
+/* call when a string is handed out by the intern table. the table is
+ * weak, so a cycle may not have reached the string yet
+ * */
+void intern_barrier(obj_string *string) {
+    if(is_marking()) {
+        gc_lock();
+        mark_object((Obj*)string);
+        gc_unlock();
+    }
+}
+
+/* first half of STORE_VAL and STORE_REF. the concurrent marker works
+ * from a snapshot of the heap taken when the cycle started, and the
+ * overwritten value may have been the last path to an object in it
+ * */
+void begin_store(Val old) {
+    if(!is_marking()) return;
+    gc_lock();
+    mark_value(old);
+}
+
+void end_store(Obj *owner, Val value) {
+    if(is_marking())
+        gc_unlock();
+    write_barrier(owner, value);
+}
+
+static void mark_array(val_array *array) {
+    for(int i = 0; i < array->count; i++)
+        mark_value(array->values[i]);
+}
+
+/* trace every reference held by an already marked object */
+static void blacken_object(Obj *object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    print_val(OBJ_VAL(object));
+    printf("\n");
+#endif
+    switch(object->type) {
+        case OBJ_CLOSURE: {
+                              obj_closure *closure = (obj_closure*)object;
+                              mark_object((Obj*)closure->function);
+                              for(int i = 0; i < closure->upvalue_count; i++)
+                                  mark_object((Obj*)closure->upvalues[i]);
+                              break;
+                          }
+        case OBJ_FUNCTION: {
+                               obj_function *function = (obj_function*)object;
+                               mark_object((Obj*)function->name);
+                               mark_array(&function->chunk.constants);
+                               break;
+                           }
+        case OBJ_ROPE: {
+                           obj_rope *rope = (obj_rope*)object;
+                           mark_object(rope->left);
+                           mark_object(rope->right);
+                           mark_object((Obj*)rope->flat);
+                           break;
+                       }
+        case OBJ_UPVALUE:
+                           mark_value(((obj_upvalue*)object)->closed);
+                           break;
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+        case OBJ_INT:
+                           break;
+    }
+}
+
 static void free_ob(Obj *object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
     /* each type of object must be handled differently */
     switch(object->type) {
         case OBJ_CLOSURE:  {
                                obj_closure *closure = (obj_closure*)object;
-                               FREE_ARRAY(obj_upvalue*, closure->upvalues, closure->upvalue_count);
-                               FREE(obj_closure, object);
+                               free_pooled(object, CLOSURE_SIZE(closure->upvalue_count));
                                break;
                            }
         case OBJ_FUNCTION: {
                                obj_function *function = (obj_function*)object;
                                freeChunk(&function->chunk);
+                               if(function->registers != NULL)
+                                   free_registers(function->registers);
+#ifdef JIT
+                               if(function->jit != NULL)
+                                   free_jit(function->jit);
+#endif
+#ifdef TRACE_JIT
+                               free_traces(function->traces);
+#endif
                                FREE(obj_function, object);
                                break;
                            }
@@ -36,39 +529,408 @@ static void free_ob(Obj *object) {
                              break;
                          }
         case OBJ_STRING: {
+                             /* the chars go with the object itself */
                              obj_string *string = (obj_string*)object;
-                             /* free the char array */
-                             FREE_ARRAY(char, string->chars, string->length + 1);
-
-                             /* free the string object itself and the 
-                              * memory it has itself allocated 
-                              * to some other resources
-                              * */
-                             FREE(obj_string, object);
+                             free_pooled(object, STRING_SIZE(string->length));
                              break;
                          }
+        case OBJ_ROPE:
+                         FREE(obj_rope, object);
+                         break;
         case OBJ_UPVALUE:
                          FREE(obj_upvalue, object);
                          break;
+        case OBJ_INT:
+                         FREE(obj_int, object);
+                         break;
     }
 }
 
-void free_objects() {
+/* roots the mutator changes without any barrier. an incremental
+ * cycle scans them once more before it may finish marking
+ * */
+static void mark_stack_roots() {
+    /* values sitting on the stack */
+    for(Val *slot = vm.stack; slot < vm.stack_top; slot++)
+        mark_value(*slot);
+
+    /* closures of every active frame */
+    for(int i = 0; i < vm.frame_count; i++)
+        mark_object((Obj*)vm.frame[i].closure);
+
+    /* upvalues that still point into the stack */
+    for(obj_upvalue *upvalue = vm.open_upvalue; upvalue != NULL; upvalue = upvalue->next)
+        mark_object((Obj*)upvalue);
+
+    /* functions the compiler is still filling in */
+    mark_compiler_roots();
+}
+
+static void mark_roots(bool full) {
+    mark_stack_roots();
+
+    if(full) {
+        /* global_slots is keyed by the names in global_names */
+        mark_array(&vm.global_names);
+        mark_array(&vm.global_values);
+        return;
+    }
+
+    /* old owners get their fields traced, nursery entries are roots */
+    for(int i = 0; i < vm.remembered_count; i++) {
+        Obj *object = vm.remembered[i];
+        if(object->is_old)
+            blacken_object(object);
+        else
+            mark_object(object);
+    }
+}
+
+/* mark at most budget global slots, true once both tables are done.
+ * stores into them go through root_write_barrier(), which shades the
+ * new value, so slots scanned in an earlier step stay covered */
+static bool mark_globals(int budget) {
+    while(name_cursor < vm.global_names.count && budget-- > 0)
+        mark_value(vm.global_names.values[name_cursor++]);
+    while(value_cursor < vm.global_values.count && budget-- > 0)
+        mark_value(vm.global_values.values[value_cursor++]);
+    return name_cursor >= vm.global_names.count && value_cursor >= vm.global_values.count;
+}
+
+static void forget_remembered() {
+    for(int i = 0; i < vm.remembered_count; i++)
+        vm.remembered[i]->is_remembered = false;
+    vm.remembered_count = 0;
+}
+
+/* blacken at most budget gray objects, true once none are left */
+static bool trace_references(int budget) {
+    while(vm.gray_count > 0 && budget-- > 0) {
+        Obj *object = vm.gray_stack[--vm.gray_count];
+        blacken_object(object);
+    }
+    return vm.gray_count == 0;
+}
+
+/* sweep at most budget objects, true once both lists are done.
+ * the nursery that was set aside when marking ended goes first, its
+ * survivors are pushed on the old generation with their marks intact
+ * so the old generation pass below clears them again
+ * */
+static bool sweep(int budget) {
+    while(young_sweep != NULL && budget-- > 0) {
+        Obj *object = young_sweep;
+        young_sweep = object->next;
+        if(object->is_marked) {
+            object->is_old = true;
+            object->next = vm.objects;
+            vm.objects = object;
+        }
+        else {
+            free_ob(object);
+        }
+    }
+    if(young_sweep != NULL) return false;
+
+    while(*sweep_link != NULL && budget-- > 0) {
+        Obj *object = *sweep_link;
+        if(object->is_marked) {
+            /* survivor, make it white again for the next cycle */
+            object->is_marked = false;
+            sweep_link = &object->next;
+            continue;
+        }
+
+        *sweep_link = object->next;
+        free_ob(object);
+    }
+    return *sweep_link == NULL;
+}
+
+/* free the dead part of the nursery and move the survivors to the old generation */
+static void sweep_young() {
+    Obj *object = vm.young_objects;
+    while(object != NULL) {
+        Obj *next = object->next;
+        if(object->is_marked) {
+            object->is_marked = false;
+            object->is_old = true;
+            if(vm.gc_state == GC_SWEEP) {
+                /* link it in behind the running sweep, it is white now */
+                object->next = *sweep_link;
+                *sweep_link = object;
+                sweep_link = &object->next;
+            }
+            else {
+                object->next = vm.objects;
+                vm.objects = object;
+            }
+        }
+        else {
+            free_ob(object);
+        }
+        object = next;
+    }
+    vm.young_objects = NULL;
+    vm.young_bytes = 0;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void record_pause(uint64_t start) {
+    uint64_t pause = now_ns() - start;
+    uint64_t micros = pause / 1000;
+    int bucket = 0;
+    while(bucket < GC_PAUSE_BUCKETS - 1 && micros >= ((uint64_t)1 << bucket))
+        bucket++;
+
+    vm.gc_pauses[bucket]++;
+    vm.gc_total_pause_ns += pause;
+    if(pause > vm.gc_max_pause_ns)
+        vm.gc_max_pause_ns = pause;
+}
+
+/* drop the unreached strings interned since the last minor collection
+ * from the intern table, older entries are either old themselves or
+ * were reached by an earlier one */
+static void remove_white_young_strings() {
+    for(int i = 0; i < vm.young_string_count; i++) {
+        obj_string *string = vm.young_strings[i];
+        if(is_white((Obj*)string))
+            delete_table(&vm.strings, string);
+    }
+    vm.young_string_count = 0;
+}
+
+/* minor collection. marking costs the live nursery objects and the
+ * remembered set, the sweep visits each nursery object once. the old
+ * generation and the rest of the intern table are never walked, the
+ * table is only rebuilt once it is mostly tombstones or empty slots */
+static void collect_young() {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytes_allocated;
+#endif
+    uint64_t start = now_ns();
+
+    collecting = true;
+    minor_cycle = true;
+    mark_roots(false);
+    trace_references(INT_MAX);
+    remove_white_young_strings();
+    shrink_table(&vm.strings);
+    forget_remembered();
+    sweep_young();
+    minor_cycle = false;
+    collecting = false;
+
+    record_pause(start);
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+            before - vm.bytes_allocated, before, vm.bytes_allocated);
+#endif
+}
+
+/* everything reachable is marked and the intern table no longer
+ * refers to white strings, what is left white is garbage
+ * */
+static void finish_marking() {
+    /* remembered owners may be freed below */
+    forget_remembered();
+    /* the whole nursery is swept along with the old generation */
+    young_sweep = vm.young_objects;
+    vm.young_objects = NULL;
+    vm.young_bytes = 0;
+    /* the intern table has been purged of every white string */
+    vm.young_string_count = 0;
+    sweep_link = &vm.objects;
+    vm.gc_state = GC_SWEEP;
+}
+
+static void finish_cycle() {
+    vm.gc_state = GC_IDLE;
+    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+}
+
+/* first increment of a cycle. only the stack roots are greyed here,
+ * the global tables and the tracing follow in later steps while the
+ * program keeps running. objects allocated from now until marking
+ * ends start out black
+ * */
+static void start_cycle() {
+#ifdef DEBUG_LOG_GC
+    printf("-- incremental gc begin\n");
+#endif
+    uint64_t start = now_ns();
+
+    collecting = true;
+    mark_stack_roots();
+    name_cursor = 0;
+    value_cursor = 0;
+    globals_marked = false;
+    vm.gc_state = GC_MARK;
+    vm.gc_step_debt = 0;
+    collecting = false;
+
+    record_pause(start);
+}
+
+/* one increment of the running cycle. it traces, scans or sweeps at
+ * most gc_step_budget objects or slots. there are two exceptions. the
+ * stack, frames and open upvalues are rescanned in one go whenever
+ * marking looks finished, the mutator writes those without barriers.
+ * that pause grows with the stack depth, not with the heap. and the
+ * step that ends the pass over the intern table rebuilds it, smaller,
+ * if it lost most of its strings */
+void gc_step() {
+    if(vm.gc_state == GC_IDLE) return;
+    uint64_t start = now_ns();
+
+    collecting = true;
+    vm.gc_step_debt = 0;
+    switch(vm.gc_state) {
+        case GC_MARK:
+            if(!globals_marked) {
+                if(!mark_globals(vm.gc_step_budget))
+                    break;
+                globals_marked = true;
+                if(vm.gc_concurrent)
+                    start_marker();
+                break;
+            }
+            if(marker_running) {
+                /* leave the tracing to the helper thread, unless the
+                 * program allocates faster than it marks */
+                if(!marker_finished() &&
+                        vm.bytes_allocated < vm.next_gc * GC_HEAP_GROW_FACTOR)
+                    break;
+                /* whatever it left gray, and whatever the barriers
+                 * shaded in the meantime, is traced below a budget at
+                 * a time */
+                join_marker(true);
+            }
+            if(trace_references(vm.gc_step_budget)) {
+                /* the stack may hold objects the barriers never saw.
+                 * marking is only over once a rescan turns up nothing */
+                mark_stack_roots();
+                if(vm.gray_count == 0) {
+                    vm.gc_state = GC_WEAK;
+                    weak_cursor = 0;
+                    weak_entries = vm.strings.entries;
+                }
+            }
+            break;
+        case GC_WEAK:
+            /* only strings revived through the intern table can be gray
+             * here. they are marked already, so the table step below
+             * keeps them, but the gray stack must be empty by the sweep */
+            if(!trace_references(vm.gc_step_budget))
+                break;
+            if(vm.strings.entries != weak_entries) {
+                /* the table was rebuilt in between, start over */
+                weak_cursor = 0;
+                weak_entries = vm.strings.entries;
+            }
+            if(table_remove_white_step(&vm.strings, &weak_cursor, vm.gc_step_budget)) {
+                shrink_table(&vm.strings);
+                finish_marking();
+            }
+            break;
+        case GC_SWEEP:
+            if(sweep(vm.gc_step_budget)) {
+                finish_cycle();
+#ifdef DEBUG_LOG_GC
+                printf("-- incremental gc end, next at %zu\n", vm.next_gc);
+#endif
+            }
+            break;
+        case GC_IDLE:
+            break;
+    }
+    collecting = false;
+
+    record_pause(start);
+}
+
+void collect_garbage() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm.bytes_allocated;
+#endif
+    uint64_t start = now_ns();
+
+    collecting = true;
+    join_marker(true);
+    /* an incremental cycle that is still sweeping has to finish first,
+     * one that is still marking simply carries on below */
+    if(vm.gc_state == GC_SWEEP)
+        sweep(INT_MAX);
+
+    vm.gc_state = GC_MARK;
+    mark_roots(true);
+    trace_references(INT_MAX);
+    /* the intern table must not keep strings alive by itself */
+    table_remove_white(&vm.strings);
+    finish_marking();
+    sweep(INT_MAX);
+    finish_cycle();
+    collecting = false;
+
+    record_pause(start);
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+            before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
+#endif
+}
+
+void print_gc_stats() {
+    size_t pauses = 0;
+    for(int i = 0; i < GC_PAUSE_BUCKETS; i++)
+        pauses += vm.gc_pauses[i];
+
+    fprintf(stderr, "gc: %s, %zu pauses, %.3f ms total, %.3f ms max\n",
+            vm.gc_concurrent ? "concurrent" :
+            vm.gc_incremental ? "incremental" : "stop-the-world", pauses,
+            vm.gc_total_pause_ns / 1e6, vm.gc_max_pause_ns / 1e6);
+    for(int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if(vm.gc_pauses[i] == 0) continue;
+        fprintf(stderr, "  < %8llu us %10zu\n", 1ull << i, vm.gc_pauses[i]);
+    }
+}
+
+static int free_list(Obj *object) {
     /* simply traverse the linked list and free each node */
-    Obj *object = vm.objects;
-#ifdef DEBUG_TRACE_EXECUTION
     int counter = 0;
-#endif
     while(object != NULL) {
         Obj *next = object->next;
         free_ob(object);
         object = next;
-#ifdef DEBUG_TRACE_EXECUTION
         counter++;
-#endif
     }
+    return counter;
+}
+
+void free_objects() {
+    join_marker(true);
+    int counter = free_list(vm.objects) + free_list(vm.young_objects) + free_list(young_sweep);
+    young_sweep = NULL;
 #ifdef DEBUG_TRACE_EXECUTION
     if(counter > 0)
         printf("\nfreed %d allocated objects before exiting\n", counter);
+#else
+    (void)counter;
+#endif
+#ifdef DEBUG_LOG_GC
+    print_pool_stats();
 #endif
+    free_pools();
+    free(vm.gray_stack);
+    free(vm.remembered);
+    free(vm.young_strings);
 }
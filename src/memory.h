@@ -14,12 +14,71 @@
     (type*)reallocate(pointer, sizeof(type)*(oldCount), sizeof(type)*(newCount)) //see the prototype of reallocate below
 
 
+/* objects up to POOL_MAX_SIZE bytes are carved out of per-size-class
+ * slabs instead of one malloc() each. a class holds slots of
+ * (index + 1) * POOL_GRANULE bytes
+ * */
+#define POOL_GRANULE 16
+#define POOL_CLASSES 8
+#define POOL_MAX_SIZE (POOL_GRANULE * POOL_CLASSES)
+
+/* objects traced or swept by one incremental step */
+#define GC_DEFAULT_STEP_BUDGET 1024
+
 /* why not use free() itself? Can't track memeopry that way! */
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(type, pointer) free_pooled(pointer, sizeof(type))
 
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type)*(oldCount),0) //->newSize = 0
 
+/* stores into a field of a heap object the collector traces must go
+ * through these, so the collector sees both the reference that is
+ * overwritten and the one that is written
+ * */
+#define STORE_VAL(owner, field, value) \
+    do { \
+        Val stored_ = (value); \
+        begin_store(field); \
+        (field) = stored_; \
+        end_store((Obj*)(owner), stored_); \
+    } while(false)
+
+#define STORE_REF(owner, field, value) \
+    do { \
+        Obj *stored_ = (Obj*)(value); \
+        begin_store(OBJ_VAL(field)); \
+        (field) = (void*)stored_; \
+        end_store((Obj*)(owner), OBJ_VAL(stored_)); \
+    } while(false)
+
+typedef struct {
+    size_t slot_size;
+    int slabs;
+    size_t live;         //slots currently handed out
+    size_t allocations;  //slots handed out since startup
+    size_t frees;
+} pool_stats;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize); //return a void pointer that is type-casted
+void *allocate_pooled(size_t size);
+void free_pooled(void *pointer, size_t size);
+size_t pooled_size(size_t size);
+pool_stats get_pool_stats(int size_class);
+void print_pool_stats();
+void mark_object(Obj *object);
+void mark_value(Val value);
+bool is_white(Obj *object);
+void write_barrier(Obj *owner, Val value);
+void root_write_barrier(Val value);
+/* note a string added to the intern table while it is in the nursery */
+void remember_young_string(obj_string *string);
+void intern_barrier(obj_string *string);
+void begin_store(Val old);
+void end_store(Obj *owner, Val value);
+void gc_lock();
+void gc_unlock();
+void collect_garbage();
+void gc_step();
+void print_gc_stats();
 void free_objects();
 #endif
@@ -1,4 +1,6 @@
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -13,26 +15,29 @@
     (type *)allocate_object(sizeof(type), objtype)
 
 
-/* allocate the OBJECT on the heap */
+/* allocate the OBJECT on the heap, small objects come from the slab pools */
 static Obj *allocate_object(size_t size, object_type type) {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
+    Obj *object = (Obj *)allocate_pooled(size);
     object->type = type;
-    /* Update the GC list */
-    object->next = vm.objects;
-    vm.objects = object;
+    /* allocate black until an incremental cycle is done marking */
+    object->is_marked = vm.gc_state == GC_MARK || vm.gc_state == GC_WEAK;
+    object->is_old = false;
+    object->is_remembered = false;
+    /* Update the GC list, new objects always start in the nursery */
+    object->next = vm.young_objects;
+    vm.young_objects = object;
+    vm.young_bytes += pooled_size(size);
     return object;
 }
 
 obj_closure *new_closure(obj_function *function) {
-    obj_upvalue **upvalues = ALLOCATE(obj_upvalue*, function->up_count);
-
-    for(int i = 0;i < function->up_count; i++)
-        upvalues[i] = NULL;
-
-    obj_closure *closure = ALLOCATE_OBJ(obj_closure, OBJ_CLOSURE);
+    obj_closure *closure = (obj_closure*)allocate_object(
+            CLOSURE_SIZE(function->up_count), OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
+    write_barrier((Obj*)closure, OBJ_VAL(function));
     closure->upvalue_count = function->up_count;
+    for(int i = 0;i < function->up_count; i++)
+        closure->upvalues[i] = NULL;
     return closure;
 }
 
@@ -40,8 +45,14 @@ obj_function *new_function() {
     obj_function *function = ALLOCATE_OBJ(obj_function, OBJ_FUNCTION);
     function->arity = 0;
     function->up_count = 0;
+    function->max_stack = 0;
     function->name = NULL;
     initChunk(&function->chunk);
+    function->registers = NULL;
+    function->jit = NULL;
+    function->calls = 0;
+    function->traces = NULL;
+    function->aot = NULL;
     return function;
 }
 
@@ -51,17 +62,23 @@ obj_native *new_native(native function) {
     return n;
 }
 
-/* allocate the string on the heap */
-static obj_string *allocate_string(char *chars, int length, uint32_t hash) {
-    obj_string *string = ALLOCATE_OBJ(obj_string, OBJ_STRING);
+/* a string of length chars, uninterned and with its contents left to
+ * the caller. hand it to intern_string() once they are filled in */
+obj_string *new_string(int length) {
+    obj_string *string = (obj_string*)allocate_object(STRING_SIZE(length), OBJ_STRING);
     string->length = length;
-    string->chars = chars;
+    string->hash = 0;
+    string->chars[length] = '\0';
+    return string;
+}
+
+static void add_intern(obj_string *string, uint32_t hash) {
     string->hash = hash;
     /* whenever a new string is created, add it to the hash */
-    /* push(OBJ_VAL(string)); */
+    push(OBJ_VAL(string));
     set_table(&vm.strings, string, NIL_VAL);
-    /* pop(); */
-    return string;
+    pop();
+    remember_young_string(string);
 }
 
 static uint32_t hash_function(const char *key, int length) {
@@ -74,31 +91,92 @@ static uint32_t hash_function(const char *key, int length) {
     return hash;
 }
 
-/* claims ownership of the passed string */
-obj_string *take_string(char *chars, int length) {
-
-    uint32_t hash = hash_function(chars, length);
-    obj_string *intern = table_find(&vm.strings, chars, length, hash);
+/* the interned string equal to the passed one from new_string(). if
+ * there already is one, the passed string is left to the collector */
+obj_string *intern_string(obj_string *string) {
+    uint32_t hash = hash_function(string->chars, string->length);
+    obj_string *intern = table_find(&vm.strings, string->chars, string->length, hash);
     if(intern != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        intern_barrier(intern);
         return  intern;
     }
 
-    return allocate_string(chars, length, hash);
+    add_intern(string, hash);
+    return string;
 }
 
 obj_string *copy_string(const char *chars, int length) {
     uint32_t hash = hash_function(chars, length);
 
     obj_string *intern = table_find(&vm.strings, chars, length, hash);
-    if(intern != NULL) 
+    if(intern != NULL) {
+        intern_barrier(intern);
         return  intern;
+    }
 
-    char *heap_char = ALLOCATE(char, length + 1);
-    memcpy(heap_char, chars, length);
-    heap_char[length] = '\0';
+    obj_string *string = new_string(length);
+    memcpy(string->chars, chars, length);
+    add_intern(string, hash);
+    return string;
+}
 
-    return allocate_string(heap_char, length, hash);
+/* left and right must stay reachable until the rope is */
+obj_rope *new_rope(Obj *left, Obj *right, int length) {
+    obj_rope *rope = ALLOCATE_OBJ(obj_rope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    write_barrier((Obj*)rope, OBJ_VAL(left));
+    write_barrier((Obj*)rope, OBJ_VAL(right));
+    return rope;
+}
+
+/* the interned string with the chars of rope. the rope must stay
+ * reachable, the result is cached in it from then on */
+obj_string *flatten_rope(obj_rope *rope) {
+    if(rope->flat != NULL)
+        return rope->flat;
+
+    obj_string *string = new_string(rope->length);
+
+    /* copy from the back, the ropes a loop builds lean to the left.
+     * the left halves still to do wait on a stack of their own, it
+     * stays short for those. it is the system allocator's, so the
+     * unrooted string can't be collected meanwhile
+     * */
+    Obj **pending = NULL;
+    int count = 0;
+    int capacity = 0;
+    char *end = string->chars + rope->length;
+    Obj *node = (Obj*)rope;
+    for(;;) {
+        if(node->type == OBJ_ROPE && ((obj_rope*)node)->flat == NULL) {
+            if(capacity < count + 1) {
+                capacity = GROW_CAPACITY(capacity);
+                pending = (Obj**)realloc(pending, sizeof(Obj*) * capacity);
+                if(pending == NULL)
+                    exit(1);
+            }
+            pending[count++] = ((obj_rope*)node)->left;
+            node = ((obj_rope*)node)->right;
+            continue;
+        }
+        obj_string *piece = node->type == OBJ_ROPE
+            ? ((obj_rope*)node)->flat : (obj_string*)node;
+        end -= piece->length;
+        memcpy(end, piece->chars, piece->length);
+        if(count == 0)
+            break;
+        node = pending[--count];
+    }
+    free(pending);
+
+    string = intern_string(string);
+    STORE_REF(rope, rope->flat, string);
+    STORE_REF(rope, rope->left, NULL);
+    STORE_REF(rope, rope->right, NULL);
+    return string;
 }
 
 obj_upvalue *new_upvalue(Val *slot) {
@@ -109,6 +187,15 @@ obj_upvalue *new_upvalue(Val *slot) {
     return upvalue;
 } 
 
+/* the integer inline when it fits, boxed on the heap otherwise */
+Val integer_val(int64_t value) {
+    if(value >= VAL_INT_MIN && value <= VAL_INT_MAX)
+        return INT_VAL(value);
+    obj_int *integer = ALLOCATE_OBJ(obj_int, OBJ_INT);
+    integer->integer = value;
+    return OBJ_VAL(integer);
+}
+
 static void print_function(obj_function *function) {
     if(function->name == NULL) {
         printf("<script>");
@@ -166,8 +253,21 @@ void print_object(Val value) {
                              if(x[len-2] != '\\') printf("%c", x[len - 1]);
                              break;
                          }
+        case OBJ_ROPE: {
+                         /* printing must not allocate, the interpreter
+                          * flattens ropes before it prints them */
+                         obj_rope *rope = AS_ROPE(value);
+                         if(rope->flat != NULL)
+                             print_object(OBJ_VAL(rope->flat));
+                         else
+                             printf("<rope of %d chars>", rope->length);
+                         break;
+                     }
         case OBJ_UPVALUE:
                          printf("upvalue");
                          break;
+        case OBJ_INT:
+                         printf("%" PRId64, AS_BIG_INT(value));
+                         break;
     }
 }
@@ -4,16 +4,22 @@
 #include "common.h"
 #include "value.h"
 #include "chunk.h"
+#include "regcode.h"
+#include "jit.h"
 
 #define OBJ_TYPE(value)      (AS_OBJ(value)->type)
 #define IS_NATIVE(value)     is_object_type(value, OBJ_NATIVE)
 #define IS_STRING(str)       is_object_type(str, OBJ_STRING)
+#define IS_ROPE(value)       is_object_type(value, OBJ_ROPE)
+/* anything the language treats as a string */
+#define IS_TEXT(value)       (IS_STRING(value) || IS_ROPE(value))
+#define AS_ROPE(value)       ((obj_rope*)AS_OBJ(value))
 #define AS_STRING(value)     ((obj_string*)AS_OBJ(value))
 #define AS_FUNCTION(value)   ((obj_function*)AS_OBJ(value))
 #define AS_CSTRING(value)    (((obj_string*)AS_OBJ(value))->chars)
 #define AS_CLOSURE(value)           ((obj_closure*) AS_OBJ(value))
 #define IS_FUNCTION(value)   is_object_type(value, OBJ_FUNCTION)
-#define IS_CLOSURE(value)    is_object_type(value, OBJ_CLOSURE);
+#define IS_CLOSURE(value)    is_object_type(value, OBJ_CLOSURE)
 
 /* define the object held in the Obj */
 typedef enum {
@@ -21,11 +27,21 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_STRING,
-    OBJ_UPVALUE
+    OBJ_ROPE,
+    OBJ_UPVALUE,
+    OBJ_INT
 } object_type;
 
+/* the flags each get their own byte, the concurrent marker writes
+ * is_marked while the interpreter updates the other two */
 struct Obj {
-    object_type type;
+    uint8_t type;
+    /* set by the collector while tracing, cleared again on sweep */
+    bool is_marked;
+    /* survived a collection, lives on vm.objects instead of the nursery */
+    bool is_old;
+    /* already queued on vm.remembered */
+    bool is_remembered;
     /*My own small garbage collector*/
     struct Obj *next;
 };
@@ -42,7 +58,18 @@ typedef struct {
     Obj obj;
     int arity; //arg count of the function
     int up_count;
+    /* the most values its frame holds at once, locals and temporaries */
+    int max_stack;
     Chunk chunk;
+    /* the chunk translated to register code, NULL if it can't be */
+    reg_chunk *registers;
+    /* the chunk as machine code once it has been called often enough */
+    jit_code *jit;
+    uint32_t calls;
+    /* the loops that got hot while it was interpreted */
+    loop_trace *traces;
+    /* the function compiled ahead of time to C, run like jit code */
+    Val *(*aot)(struct call_frame *frame, Val *sp);
     obj_string *name;
 } obj_function;
 
@@ -52,21 +79,47 @@ typedef struct {
     native function;
 } obj_native;
 
+/* the characters follow the header in the same allocation */
 struct obj_string {
     Obj obj;
     int length;
-    char *chars;  //heap allocation for the chars
     /* cache the string name for a variable */
     uint32_t hash;
+    char chars[];
 };
 
+/* concatenations of at least this many chars become ropes */
+#define ROPE_MIN_LENGTH 128
+
+/* a concatenation whose chars are only copied into a flat string once
+ * they are needed. left and right are strings or ropes, both dropped
+ * once flat is set */
+typedef struct {
+    Obj obj;
+    int length;
+    Obj *left;
+    Obj *right;
+    obj_string *flat;
+} obj_rope;
+
 typedef struct {
     Obj obj;
     obj_function *function;
-    obj_upvalue **upvalues;
     int upvalue_count;
+    obj_upvalue *upvalues[];
 } obj_closure;
 
+/* an integer too wide to sit in a Val inline, only NaN boxing has them.
+ * integer_val() boxes exactly the ones outside VAL_INT_MIN..VAL_INT_MAX,
+ * so an inline and a boxed integer are never equal */
+typedef struct {
+    Obj obj;
+    int64_t integer;
+} obj_int;
+
+#define STRING_SIZE(length) (sizeof(obj_string) + (length) + 1)
+#define CLOSURE_SIZE(count) (sizeof(obj_closure) + sizeof(obj_upvalue*) * (count))
+
 obj_closure *new_closure(obj_function *function);
 obj_function *new_function();
 obj_native *new_native(native function);
@@ -77,9 +130,32 @@ static inline bool is_object_type(Val value, object_type type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+#ifdef NAN_BOXING
+#define IS_BIG_INT(value)    is_object_type(value, OBJ_INT)
+#else
+#define IS_BIG_INT(value)    false
+#endif
+#define AS_BIG_INT(value)    (((obj_int*)AS_OBJ(value))->integer)
+/* integers inline or boxed, and numbers of every kind */
+#define IS_INTEGER(value)    (IS_INT(value) || IS_BIG_INT(value))
+#define IS_NUMERIC(value)    (IS_NUMBER(value) || IS_BIG_INT(value))
+
+static inline int64_t as_integer(Val value) {
+    return IS_INT(value) ? AS_INT(value) : AS_BIG_INT(value);
+}
+
+static inline double as_numeric(Val value) {
+    return IS_BIG_INT(value) ? (double)AS_BIG_INT(value) : AS_NUMBER(value);
+}
+
+Val integer_val(int64_t value);
+
 
-obj_string *take_string(char *chars, int length);
+obj_string *new_string(int length);
+obj_string *intern_string(obj_string *string);
 obj_string *copy_string(const char *chars, int length);
+obj_rope *new_rope(Obj *left, Obj *right, int length);
+obj_string *flatten_rope(obj_rope *rope);
 void print_object(Val value);
 
 /* This is essentially the definition of a string.
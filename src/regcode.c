@@ -0,0 +1,393 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "regcode.h"
+
+/* constant registers that don't come from the chunk's constants */
+#define KEY_NIL   -1
+#define KEY_TRUE  -2
+#define KEY_FALSE -3
+
+/* a translation in progress. the operand stack is simulated instruction
+ * by instruction, a push of a local or a constant only notes the
+ * register the value is in and an operator reads it from there. values
+ * are copied to their own stack position's register where control flow
+ * meets, or before the register they are noted in is overwritten */
+typedef struct {
+    Chunk *chunk;
+    reg_chunk *code;
+    bool failed;
+    /* which stack offsets are jumped to, and the stack depth there */
+    bool *labels;
+    int *depths;
+    /* register code index of each stack offset, for the jumps */
+    int *starts;
+    int depth;
+    uint8_t where[UINT8_COUNT];
+    /* the stack position the last emitted instruction computed, -1 if
+     * something else was emitted after it */
+    int produced;
+    /* a chunk constant index or a KEY_ for each constant register */
+    int const_keys[UINT8_COUNT];
+} translator;
+
+/* bytes of a stack instruction, 0 for one with no register form */
+static int stack_length(uint8_t op) {
+    switch(op) {
+        case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_POP:
+        case OP_EQUAL: case OP_GREATER: case OP_LESS:
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+        case OP_NOT: case OP_NEGATE: case OP_PRINT: case OP_RETURN:
+            return 1;
+        case OP_CONSTANT: case OP_GET_LOCAL: case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            return 2;
+        case OP_GET_GLOBAL:
+        case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_LOOP:
+        case OP_ADD_LOCALS: case OP_ADD_LOCAL_CONST: case OP_LESS_LOCAL_CONST:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+/* how many values a stack instruction leaves on the stack minus how
+ * many it takes */
+static int stack_effect(uint8_t op) {
+    switch(op) {
+        case OP_CONSTANT: case OP_NIL: case OP_TRUE: case OP_FALSE:
+        case OP_GET_LOCAL: case OP_GET_GLOBAL:
+        case OP_ADD_LOCALS: case OP_ADD_LOCAL_CONST: case OP_LESS_LOCAL_CONST:
+            return 1;
+        case OP_POP: case OP_EQUAL: case OP_GREATER: case OP_LESS:
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+        case OP_PRINT: case OP_RETURN: case OP_SET_LOCAL_POP:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+static int jump_target(Chunk *chunk, int offset) {
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+/* code after a jump, loop or return is only reached by jumping to it */
+static bool falls_through(uint8_t op) {
+    return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+}
+
+/* find the jump targets and the deepest the stack gets. every path to
+ * an offset has to arrive with the same depth, the stack code the
+ * compiler emits always does */
+static bool scan(translator *t, int arity, int *max_depth) {
+    Chunk *chunk = t->chunk;
+    int *depths = t->depths;
+    for(int i = 0; i <= chunk->count; i++)
+        depths[i] = -1;
+
+    bool ok = true;
+    bool reachable = true;
+    int depth = arity + 1;
+    *max_depth = depth;
+    for(int offset = 0; ok && offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        if(!reachable && depths[offset] != -1)
+            depth = depths[offset];
+        int length = stack_length(op);
+        if(length == 0 || offset + length > chunk->count
+                || (depths[offset] != -1 && depths[offset] != depth)) {
+            ok = false;
+            break;
+        }
+        depths[offset] = depth;
+
+        if(op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP) {
+            int target = jump_target(chunk, offset);
+            if(target < 0 || target > chunk->count
+                    || (depths[target] != -1 && depths[target] != depth)) {
+                ok = false;
+                break;
+            }
+            depths[target] = depth;
+            t->labels[target] = true;
+        }
+
+        depth += stack_effect(op);
+        if(depth < 1 || depth > UINT8_COUNT) {
+            ok = false;
+            break;
+        }
+        if(depth > *max_depth)
+            *max_depth = depth;
+        reachable = falls_through(op);
+        offset += length;
+    }
+    return ok;
+}
+
+static void emit(translator *t, uint8_t op, int a, int b, int c, int origin) {
+    reg_chunk *code = t->code;
+    if(code->capacity < code->count + 1) {
+        int old_capacity = code->capacity;
+        int capacity = GROW_CAPACITY(old_capacity);
+        code->code = GROW_ARRAY(reg_inst, code->code, old_capacity, capacity);
+        code->origins = GROW_ARRAY(int, code->origins, old_capacity, capacity);
+        code->capacity = capacity;
+    }
+    code->code[code->count] = (reg_inst){op, (uint8_t)a, (uint8_t)b, (uint8_t)c};
+    code->origins[code->count] = origin;
+    code->count++;
+    t->produced = -1;
+}
+
+static int constant_register(translator *t, int key) {
+    reg_chunk *code = t->code;
+    for(int i = 0; i < code->const_count; i++)
+        if(t->const_keys[i] == key)
+            return code->const_base + i;
+
+    if(REG_COUNT(code) == UINT8_COUNT) {
+        t->failed = true;
+        return 0;
+    }
+    t->const_keys[code->const_count] = key;
+    return code->const_base + code->const_count++;
+}
+
+static void push_register(translator *t, int reg) {
+    t->where[t->depth++] = (uint8_t)reg;
+}
+
+/* op computes the value of the next stack position into its register */
+static void produce(translator *t, uint8_t op, int b, int c, int origin) {
+    emit(t, op, t->depth, b, c, origin);
+    t->produced = t->depth;
+    push_register(t, t->depth);
+}
+
+static void binary(translator *t, uint8_t op, int origin) {
+    int c = t->where[--t->depth];
+    int b = t->where[--t->depth];
+    produce(t, op, b, c, origin);
+}
+
+/* copy every value still noted in another register to its own */
+static void flush(translator *t, int origin) {
+    for(int p = 0; p < t->depth; p++) {
+        if(t->where[p] != p) {
+            emit(t, REG_MOVE, p, t->where[p], 0, origin);
+            t->where[p] = (uint8_t)p;
+        }
+    }
+}
+
+/* the top of the stack is stored into local slot */
+static void store_local(translator *t, int slot, int origin) {
+    int top = t->depth - 1;
+    int value = t->where[top];
+    if(value == slot) return;
+
+    bool aliased = false;
+    for(int p = 0; p < top; p++)
+        if(p != slot && t->where[p] == slot)
+            aliased = true;
+
+    /* the value was just computed, compute it into the local instead */
+    if(!aliased && t->produced == top && value == top) {
+        t->code->code[t->code->count - 1].a = (uint8_t)slot;
+        t->where[top] = (uint8_t)slot;
+        t->where[slot] = (uint8_t)slot;
+        t->produced = -1;
+        return;
+    }
+
+    for(int p = 0; p < top; p++) {
+        if(p != slot && t->where[p] == slot) {
+            emit(t, REG_MOVE, p, slot, 0, origin);
+            t->where[p] = (uint8_t)p;
+        }
+    }
+    emit(t, REG_MOVE, slot, value, 0, origin);
+    t->where[slot] = (uint8_t)slot;
+}
+
+static void translate(translator *t, int offset) {
+    Chunk *chunk = t->chunk;
+    uint8_t *ip = &chunk->code[offset];
+    switch(ip[0]) {
+        case OP_CONSTANT:
+            push_register(t, constant_register(t, ip[1]));
+            break;
+        case OP_NIL:
+            push_register(t, constant_register(t, KEY_NIL));
+            break;
+        case OP_TRUE:
+            push_register(t, constant_register(t, KEY_TRUE));
+            break;
+        case OP_FALSE:
+            push_register(t, constant_register(t, KEY_FALSE));
+            break;
+        case OP_POP:
+            t->depth--;
+            break;
+        case OP_GET_LOCAL:
+            push_register(t, t->where[ip[1]]);
+            break;
+        case OP_SET_LOCAL:
+            store_local(t, ip[1], offset);
+            break;
+        case OP_SET_LOCAL_POP:
+            store_local(t, ip[1], offset);
+            t->depth--;
+            break;
+        case OP_GET_GLOBAL:
+            produce(t, REG_GET_GLOBAL, ip[1], ip[2], offset);
+            break;
+        case OP_EQUAL:    binary(t, REG_EQUAL, offset); break;
+        case OP_GREATER:  binary(t, REG_GREATER, offset); break;
+        case OP_LESS:     binary(t, REG_LESS, offset); break;
+        case OP_ADD:      binary(t, REG_ADD, offset); break;
+        case OP_SUBTRACT: binary(t, REG_SUBTRACT, offset); break;
+        case OP_MULTIPLY: binary(t, REG_MULTIPLY, offset); break;
+        case OP_DIVIDE:   binary(t, REG_DIVIDE, offset); break;
+        case OP_NOT:
+            produce(t, REG_NOT, t->where[--t->depth], 0, offset);
+            break;
+        case OP_NEGATE:
+            produce(t, REG_NEGATE, t->where[--t->depth], 0, offset);
+            break;
+        case OP_ADD_LOCALS:
+            push_register(t, t->where[ip[1]]);
+            push_register(t, t->where[ip[2]]);
+            binary(t, REG_ADD, offset);
+            break;
+        case OP_ADD_LOCAL_CONST:
+            push_register(t, t->where[ip[1]]);
+            push_register(t, constant_register(t, ip[2]));
+            binary(t, REG_ADD, offset);
+            break;
+        case OP_LESS_LOCAL_CONST:
+            push_register(t, t->where[ip[1]]);
+            push_register(t, constant_register(t, ip[2]));
+            binary(t, REG_LESS, offset);
+            break;
+        case OP_PRINT:
+            emit(t, REG_PRINT, t->where[--t->depth], 0, 0, offset);
+            break;
+        case OP_RETURN:
+            emit(t, REG_RETURN, t->where[--t->depth], 0, 0, offset);
+            break;
+        case OP_JUMP:
+        case OP_LOOP: {
+            /* the target is a stack offset until every start is known */
+            int target = jump_target(chunk, offset);
+            if(chunk->code[offset] == OP_LOOP)
+                t->code->loops = true;
+            flush(t, offset);
+            emit(t, REG_JUMP, 0, target >> 8, target & 0xff, offset);
+            break;
+        }
+        case OP_JUMP_IF_FALSE: {
+            int target = jump_target(chunk, offset);
+            flush(t, offset);
+            emit(t, REG_JUMP_IF_FALSE, t->depth - 1, target >> 8, target & 0xff, offset);
+            break;
+        }
+    }
+}
+
+reg_chunk *compile_registers(Chunk *chunk, int arity) {
+    if(chunk->count > UINT16_MAX)
+        return NULL;
+
+    translator t;
+    t.chunk = chunk;
+    t.failed = false;
+    t.labels = calloc(chunk->count + 1, sizeof(bool));
+    t.starts = malloc(sizeof(int) * (chunk->count + 1));
+    t.depths = malloc(sizeof(int) * (chunk->count + 1));
+    t.produced = -1;
+
+    int max_depth;
+    if(!scan(&t, arity, &max_depth)) {
+        free(t.labels);
+        free(t.starts);
+        free(t.depths);
+        return NULL;
+    }
+
+    reg_chunk *code = ALLOCATE(reg_chunk, 1);
+    code->count = 0;
+    code->capacity = 0;
+    code->code = NULL;
+    code->origins = NULL;
+    code->const_base = max_depth;
+    code->const_count = 0;
+    code->constants = NULL;
+    code->loops = false;
+    t.code = code;
+
+    t.depth = arity + 1;
+    for(int p = 0; p < t.depth; p++)
+        t.where[p] = (uint8_t)p;
+    bool reachable = true;
+    for(int offset = 0; offset < chunk->count && !t.failed;
+            offset += stack_length(chunk->code[offset])) {
+        /* every way in has all values in their own registers */
+        if(t.labels[offset]) {
+            if(reachable)
+                flush(&t, offset);
+            t.depth = t.depths[offset];
+            for(int p = 0; p < t.depth; p++)
+                t.where[p] = (uint8_t)p;
+            t.produced = -1;
+        }
+        t.starts[offset] = code->count;
+        translate(&t, offset);
+        reachable = falls_through(chunk->code[offset]);
+    }
+    t.starts[chunk->count] = code->count;
+
+    if(code->count > UINT16_MAX)
+        t.failed = true;
+    for(int i = 0; i < code->count && !t.failed; i++) {
+        reg_inst *inst = &code->code[i];
+        if(inst->op == REG_JUMP || inst->op == REG_JUMP_IF_FALSE) {
+            int target = t.starts[REG_BC(*inst)];
+            inst->b = (uint8_t)(target >> 8);
+            inst->c = (uint8_t)(target & 0xff);
+        }
+    }
+    free(t.labels);
+    free(t.starts);
+    free(t.depths);
+    if(t.failed) {
+        free_registers(code);
+        return NULL;
+    }
+
+    code->constants = ALLOCATE(Val, code->const_count);
+    for(int i = 0; i < code->const_count; i++) {
+        switch(t.const_keys[i]) {
+            case KEY_NIL:   code->constants[i] = NIL_VAL; break;
+            case KEY_TRUE:  code->constants[i] = BOOL_VAL(true); break;
+            case KEY_FALSE: code->constants[i] = BOOL_VAL(false); break;
+            default:        code->constants[i] = chunk->constants.values[t.const_keys[i]];
+        }
+    }
+    return code;
+}
+
+void free_registers(reg_chunk *code) {
+    FREE_ARRAY(reg_inst, code->code, code->capacity);
+    FREE_ARRAY(int, code->origins, code->capacity);
+    FREE_ARRAY(Val, code->constants, code->const_count);
+    FREE_ARRAY(reg_chunk, code, 1);
+}
+
+size_t registers_size(reg_chunk *code) {
+    return sizeof(reg_chunk) + code->capacity * (sizeof(reg_inst) + sizeof(int))
+        + code->const_count * sizeof(Val);
+}
@@ -0,0 +1,65 @@
+#ifndef clox_regcode_h
+#define clox_regcode_h
+
+#include "chunk.h"
+
+/* register code addresses the frame's slots directly, `ADD a b c` is
+ * slots[a] = slots[b] + slots[c]. registers below const_base are the
+ * stack positions of the function's stack code, the callee and its
+ * params first. the constants it uses are copied into the registers
+ * from const_base on when it is called */
+typedef enum {
+    REG_MOVE,           // a = b
+    REG_GET_GLOBAL,     // a = global slot bc
+    REG_EQUAL,          // a = b == c
+    REG_GREATER,        // a = b > c
+    REG_LESS,           // a = b < c
+    REG_ADD,            // a = b + c
+    REG_SUBTRACT,       // a = b - c
+    REG_MULTIPLY,       // a = b * c
+    REG_DIVIDE,         // a = b / c
+    REG_NOT,            // a = !b
+    REG_NEGATE,         // a = -b
+    REG_PRINT,          // print a
+    REG_JUMP,           // go to instruction bc
+    REG_JUMP_IF_FALSE,  // go to instruction bc when a is falsey
+    REG_RETURN          // return a
+} reg_opcode;
+
+typedef struct {
+    uint8_t op;
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+} reg_inst;
+
+/* b and c read as one 16 bit operand, a jump target or a global slot */
+#define REG_BC(inst) (((inst).b << 8) | (inst).c)
+
+typedef struct {
+    int count;
+    int capacity;
+    reg_inst *code;
+    /* offset of the stack instruction each one was translated from,
+     * errors report its line */
+    int *origins;
+    int const_base;
+    int const_count;
+    /* whether the code jumps backwards anywhere */
+    bool loops;
+    /* copies of chunk constants, nil, true and false */
+    Val *constants;
+} reg_chunk;
+
+/* the frame needs this many slots */
+#define REG_COUNT(code) ((code)->const_base + (code)->const_count)
+
+/* translate the stack code of a function with arity params, NULL for
+ * code that uses anything but locals, globals it reads, arithmetic,
+ * comparisons, print and control flow. calls, closures and upvalues
+ * all stay on the stack interpreter */
+reg_chunk *compile_registers(Chunk *chunk, int arity);
+void free_registers(reg_chunk *code);
+size_t registers_size(reg_chunk *code);
+
+#endif
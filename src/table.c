@@ -8,11 +8,15 @@
 
 /* grow the table when 75 percent full */
 #define MAX_LOAD 0.75
+/* and shrink it again once less than a quarter of the slots are live */
+#define MIN_LOAD 0.25
+#define MIN_CAPACITY 8
 
 void init_table(table *tab) {
     //Initialise the init values for the hash table
     tab->capacity = 0;
     tab->count = 0;
+    tab->tombstones = 0;
     tab->entries = NULL;
 }
 
@@ -64,6 +68,7 @@ static void adjust_table(table *tab, int capacity) {
     }
 
     tab->count = 0;
+    tab->tombstones = 0;
     for(int i = 0; i < tab->capacity; i++) {
         entry *ent = &tab->entries[i];
         if(ent->key == NULL) continue;
@@ -91,6 +96,7 @@ bool set_table(table *tab, obj_string *key, Val value) {
     bool new = ent->key == NULL;  //check if key already exists
     /* (TODO) */
     if(new && IS_NIL(ent->value)) tab->count++;
+    else if(new) tab->tombstones--;
 
     ent->key = key;
     ent->value = value;
@@ -106,6 +112,7 @@ bool delete_table(table *tab, obj_string *key) {
     //place the dummy here
     ent->key = NULL;
     ent->value = BOOL_VAL(true);
+    tab->tombstones++;
     return true;
 }
 
@@ -136,4 +143,44 @@ obj_string *table_find(table *tab, const char *chars, int length, uint32_t hash)
     }
 }
 
+/* give memory back once the collector has purged the table: a table
+ * that lost most of its keys is rebuilt smaller, and one that is
+ * mostly tombstones is rebuilt to get rid of them
+ * */
+void shrink_table(table *tab) {
+    int live = tab->count - tab->tombstones;
+    int capacity = tab->capacity;
+    while(capacity > MIN_CAPACITY && live < capacity * MIN_LOAD)
+        capacity /= 2;
+
+    if(capacity != tab->capacity || tab->tombstones > tab->capacity / 4)
+        adjust_table(tab, capacity);
+}
+
+/* drop the entries whose keys were not reached during marking.
+ * this runs right before the sweep, so it also shrinks the table
+ * */
+void table_remove_white(table *tab) {
+    if(tab->capacity == 0) return;
+
+    for(int i = 0; i < tab->capacity; i++) {
+        entry *ent = &tab->entries[i];
+        if(ent->key != NULL && is_white((Obj*)ent->key))
+            delete_table(tab, ent->key);
+    }
+    shrink_table(tab);
+}
 
+/* bounded version for the incremental collector. visits at most budget
+ * slots from *cursor on and returns true once the whole table is done.
+ * the caller shrinks the table then, the one step of the pass that may
+ * rebuild it whole
+ * */
+bool table_remove_white_step(table *tab, int *cursor, int budget) {
+    while(*cursor < tab->capacity && budget-- > 0) {
+        entry *ent = &tab->entries[(*cursor)++];
+        if(ent->key != NULL && is_white((Obj*)ent->key))
+            delete_table(tab, ent->key);
+    }
+    return *cursor >= tab->capacity;
+}
@@ -13,7 +13,9 @@ typedef struct {
 
 /* define the hash table */
 typedef struct {
+    /* live entries and tombstones, both end a probe late */
     int count;
+    int tombstones;
     int capacity;
     entry *entries;
 } table;
@@ -26,5 +28,8 @@ bool set_table(table *tab, obj_string *key, Val value);
 bool delete_table(table *tab, obj_string *key);
 void copy_table(table *from, table *to); //needed for inheritance support
 obj_string *table_find(table *tab, const char *chars, int length, uint32_t hash);
+void table_remove_white(table *tab);
+void shrink_table(table *tab);
+bool table_remove_white_step(table *tab, int *cursor, int budget);
 #endif
 
@@ -0,0 +1,485 @@
+#include "common.h"
+
+#ifdef TRACE_JIT
+
+#include "object.h"
+#include "trace.h"
+#include "vm.h"
+
+/* stack entries and globals the recorder can follow */
+#define SHADOW_MAX (2 * UINT8_COUNT)
+#define SHADOW_GLOBALS 32
+
+/* a value on the recorder's copy of the stack and the instruction of
+ * the trace that produces it, -1 for a slot the trace hasn't loaded */
+typedef struct {
+    Val value;
+    int ref;
+} shadow;
+
+typedef struct {
+    int slot;
+    shadow global;
+} shadow_global;
+
+typedef struct {
+    trace_recording *rec;
+    Val *constants;
+    shadow stack[SHADOW_MAX];
+    int depth;
+    shadow_global globals[SHADOW_GLOBALS];
+    int global_count;
+    /* the instruction being recorded and the stack before it, which
+     * is where its checks hand back to run(), once they need to */
+    uint8_t *pc;
+    int pc_depth;
+    int exit;
+    bool failed;
+} recorder;
+
+static bool type_of(Val value, uint8_t *type) {
+    if(IS_INT(value))
+        *type = TYPE_INT;
+    else if(IS_DOUBLE(value))
+        *type = TYPE_NUM;
+    else if(IS_BOOL(value))
+        *type = TYPE_BOOL;
+    else if(IS_NIL(value))
+        *type = TYPE_NIL;
+    else
+        return false;
+    return true;
+}
+
+static bool falsey(Val value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static int emit(recorder *r, uint8_t op, uint8_t type, int a, int b, int exit) {
+    trace_recording *rec = r->rec;
+    if(r->failed || rec->count == TRACE_MAX) {
+        r->failed = true;
+        return 0;
+    }
+    ir_inst *inst = &rec->ir[rec->count];
+    inst->op = op;
+    inst->type = type;
+    inst->a = a;
+    inst->b = b;
+    inst->value = NIL_VAL;
+    inst->exit = exit;
+    return rec->count++;
+}
+
+static uint8_t type_of_ref(recorder *r, int ref) {
+    return r->rec->ir[ref].type;
+}
+
+static int constant(recorder *r, Val value) {
+    uint8_t type;
+    if(!type_of(value, &type)) {
+        r->failed = true;
+        return 0;
+    }
+    int ref = emit(r, IR_CONST, type, 0, 0, -1);
+    if(!r->failed)
+        r->rec->ir[ref].value = value;
+    return ref;
+}
+
+/* resume at pc with the stack as it is up to depth */
+static int snapshot_at(recorder *r, uint8_t *pc, int depth) {
+    trace_recording *rec = r->rec;
+    if(r->failed || rec->snapshot_count == TRACE_MAX
+            || rec->ref_count + depth - rec->base > TRACE_REFS) {
+        r->failed = true;
+        return 0;
+    }
+    snapshot *snap = &rec->snapshots[rec->snapshot_count];
+    snap->pc = pc;
+    snap->depth = depth;
+    snap->refs = rec->ref_count;
+    for(int i = rec->base; i < depth; i++)
+        rec->refs[rec->ref_count++] = r->stack[i].ref;
+    return rec->snapshot_count++;
+}
+
+/* run() redoes the instruction being recorded. popping leaves the
+ * entries below pc_depth as they were, so this may come after it */
+static int exit_here(recorder *r) {
+    if(r->exit < 0)
+        r->exit = snapshot_at(r, r->pc, r->pc_depth);
+    return r->exit;
+}
+
+static void shadow_push(recorder *r, Val value, int ref) {
+    if(r->depth == SHADOW_MAX) {
+        r->failed = true;
+        return;
+    }
+    r->stack[r->depth].value = value;
+    r->stack[r->depth].ref = ref;
+    r->depth++;
+}
+
+/* the loop's own locals stay below its base */
+static shadow shadow_pop(recorder *r) {
+    if(r->depth == r->rec->base) {
+        r->failed = true;
+        return (shadow){NIL_VAL, 0};
+    }
+    return r->stack[--r->depth];
+}
+
+static void get_local(recorder *r, int slot) {
+    if(slot >= r->depth) {
+        r->failed = true;
+        return;
+    }
+    shadow *local = &r->stack[slot];
+    if(local->ref < 0) {
+        uint8_t type;
+        if(!type_of(local->value, &type)) {
+            r->failed = true;
+            return;
+        }
+        local->ref = emit(r, IR_LOAD_SLOT, type, slot, 0, exit_here(r));
+    }
+    shadow_push(r, local->value, local->ref);
+}
+
+/* the slots below the base are written right away, so they are up to
+ * date whenever the trace hands back. the ones above only exist on
+ * the copy until then */
+static void set_local(recorder *r, int slot) {
+    if(slot >= r->depth || r->depth == r->rec->base) {
+        r->failed = true;
+        return;
+    }
+    shadow top = r->stack[r->depth - 1];
+    if(slot < r->rec->base)
+        emit(r, IR_STORE_SLOT, type_of_ref(r, top.ref), slot, top.ref, -1);
+    r->stack[slot] = top;
+}
+
+static shadow *find_global(recorder *r, int slot) {
+    for(int i = 0; i < r->global_count; i++)
+        if(r->globals[i].slot == slot)
+            return &r->globals[i].global;
+    if(r->global_count == SHADOW_GLOBALS) {
+        r->failed = true;
+        return NULL;
+    }
+    shadow_global *global = &r->globals[r->global_count++];
+    global->slot = slot;
+    global->global.value = vm.global_values.values[slot];
+    global->global.ref = -1;
+    return &global->global;
+}
+
+static void get_global(recorder *r, int slot) {
+    shadow *global = find_global(r, slot);
+    if(global == NULL)
+        return;
+    if(global->ref < 0) {
+        uint8_t type;
+        if(!type_of(global->value, &type)) {
+            r->failed = true;
+            return;
+        }
+        global->ref = emit(r, IR_LOAD_GLOBAL, type, slot, 0, exit_here(r));
+    }
+    shadow_push(r, global->value, global->ref);
+}
+
+static void set_global(recorder *r, int slot) {
+    shadow *global = find_global(r, slot);
+    if(global == NULL || IS_UNDEFINED(global->value) || r->depth == r->rec->base) {
+        r->failed = true;
+        return;
+    }
+    /* a global the trace hasn't touched yet may still be undefined */
+    if(global->ref < 0)
+        emit(r, IR_CHECK_GLOBAL, TYPE_NIL, slot, 0, exit_here(r));
+    shadow top = r->stack[r->depth - 1];
+    emit(r, IR_STORE_GLOBAL, type_of_ref(r, top.ref), slot, top.ref, -1);
+    *global = top;
+}
+
+/* as run() does it. an int result that would turn into a double ends
+ * the recording, the trace keeps ints ints */
+static bool int_result(uint8_t op, int64_t a, int64_t b, int64_t *result) {
+    bool overflows = false;
+    switch(op) {
+        case IR_ADD:      overflows = __builtin_add_overflow(a, b, result); break;
+        case IR_SUBTRACT: overflows = __builtin_sub_overflow(a, b, result); break;
+        case IR_MULTIPLY: overflows = __builtin_mul_overflow(a, b, result); break;
+        case IR_DIVIDE:
+            if(b == 0 || b == -1 || a % b != 0)
+                return false;
+            *result = a / b;
+            break;
+    }
+    return !overflows && *result >= VAL_INT_MIN && *result <= VAL_INT_MAX;
+}
+
+static void arith(recorder *r, uint8_t op) {
+    shadow b = shadow_pop(r);
+    shadow a = shadow_pop(r);
+    if(r->failed || !IS_NUMBER(a.value) || !IS_NUMBER(b.value)) {
+        r->failed = true;
+        return;
+    }
+    if(IS_INT(a.value) && IS_INT(b.value)) {
+        int64_t result;
+        if(!int_result(op, AS_INT(a.value), AS_INT(b.value), &result)) {
+            r->failed = true;
+            return;
+        }
+        int ref = emit(r, op, TYPE_INT, a.ref, b.ref, exit_here(r));
+        shadow_push(r, INT_VAL(result), ref);
+        return;
+    }
+    double x = AS_NUMBER(a.value);
+    double y = AS_NUMBER(b.value);
+    double result = 0;
+    switch(op) {
+        case IR_ADD:      result = x + y; break;
+        case IR_SUBTRACT: result = x - y; break;
+        case IR_MULTIPLY: result = x * y; break;
+        case IR_DIVIDE:   result = x / y; break;
+    }
+    int ref = emit(r, op, TYPE_NUM, a.ref, b.ref, -1);
+    shadow_push(r, NUMBER_VAL(result), ref);
+}
+
+static void compare(recorder *r, uint8_t op) {
+    shadow b = shadow_pop(r);
+    shadow a = shadow_pop(r);
+    if(r->failed || !IS_NUMBER(a.value) || !IS_NUMBER(b.value)) {
+        r->failed = true;
+        return;
+    }
+    /* ints fit a double exactly, they compare the same either way */
+    bool result = op == IR_LESS ? AS_NUMBER(a.value) < AS_NUMBER(b.value)
+                                : AS_NUMBER(a.value) > AS_NUMBER(b.value);
+    int ref = emit(r, op, TYPE_BOOL, a.ref, b.ref, -1);
+    shadow_push(r, BOOL_VAL(result), ref);
+}
+
+static void equal(recorder *r) {
+    shadow b = shadow_pop(r);
+    shadow a = shadow_pop(r);
+    if(r->failed)
+        return;
+    uint8_t x = type_of_ref(r, a.ref);
+    uint8_t y = type_of_ref(r, b.ref);
+    bool numbers = (x == TYPE_INT || x == TYPE_NUM) && (y == TYPE_INT || y == TYPE_NUM);
+    bool result = is_equal(a.value, b.value);
+    /* two nils, or values of different kinds, are fixed by the types */
+    if(numbers || (x == TYPE_BOOL && y == TYPE_BOOL))
+        shadow_push(r, BOOL_VAL(result), emit(r, IR_EQUAL, TYPE_BOOL, a.ref, b.ref, -1));
+    else
+        shadow_push(r, BOOL_VAL(result), constant(r, BOOL_VAL(result)));
+}
+
+static void negate(recorder *r) {
+    shadow a = shadow_pop(r);
+    if(r->failed)
+        return;
+    if(IS_INT(a.value) && AS_INT(a.value) != VAL_INT_MIN)
+        shadow_push(r, INT_VAL(-AS_INT(a.value)), emit(r, IR_NEGATE, TYPE_INT, a.ref, 0, exit_here(r)));
+    else if(IS_DOUBLE(a.value))
+        shadow_push(r, NUMBER_VAL(-AS_DOUBLE(a.value)), emit(r, IR_NEGATE, TYPE_NUM, a.ref, 0, -1));
+    else
+        r->failed = true;
+}
+
+static void logical_not(recorder *r) {
+    shadow a = shadow_pop(r);
+    if(r->failed)
+        return;
+    Val result = BOOL_VAL(falsey(a.value));
+    if(type_of_ref(r, a.ref) == TYPE_BOOL)
+        shadow_push(r, result, emit(r, IR_NOT, TYPE_BOOL, a.ref, 0, -1));
+    else
+        shadow_push(r, result, constant(r, result));
+}
+
+/* the branch the recording takes becomes a guard, unless the type of
+ * the condition already decides it */
+static uint8_t *jump_if_false(recorder *r, uint8_t *next, uint8_t *target) {
+    if(r->depth == r->rec->base) {
+        r->failed = true;
+        return next;
+    }
+    shadow cond = r->stack[r->depth - 1];
+    bool jumps = falsey(cond.value);
+    ir_inst *inst = &r->rec->ir[cond.ref];
+    if(inst->op != IR_CONST && inst->type == TYPE_BOOL)
+        emit(r, jumps ? IR_GUARD_FALSE : IR_GUARD_TRUE, TYPE_NIL, cond.ref, 0,
+             snapshot_at(r, jumps ? next : target, r->depth));
+    return jumps ? target : next;
+}
+
+static int short_operand(uint8_t *ip) {
+    return (ip[1] << 8) | ip[2];
+}
+
+bool record_trace(trace_recording *rec, call_frame *frame, Val *sp, uint8_t *header) {
+    recorder r;
+    r.rec = rec;
+    r.constants = frame->closure->function->chunk.constants.values;
+    r.global_count = 0;
+    r.failed = false;
+    rec->count = 0;
+    rec->snapshot_count = 0;
+    rec->ref_count = 0;
+    rec->base = (int)(sp - frame->slots);
+    if(rec->base > SHADOW_MAX)
+        return false;
+    for(int i = 0; i < rec->base; i++) {
+        r.stack[i].value = frame->slots[i];
+        r.stack[i].ref = -1;
+    }
+    r.depth = rec->base;
+
+    uint8_t *ip = header;
+    for(int step = 0; step < TRACE_STEPS && !r.failed; step++) {
+        r.pc = ip;
+        r.pc_depth = r.depth;
+        r.exit = -1;
+        switch(*ip) {
+            case OP_CONSTANT: {
+                Val value = r.constants[ip[1]];
+                shadow_push(&r, value, constant(&r, value));
+                ip += 2;
+                break;
+            }
+            case OP_CONSTANT_LONG: {
+                Val value = r.constants[(ip[1] << 16) | (ip[2] << 8) | ip[3]];
+                shadow_push(&r, value, constant(&r, value));
+                ip += 4;
+                break;
+            }
+            case OP_NIL:
+                shadow_push(&r, NIL_VAL, constant(&r, NIL_VAL));
+                ip++;
+                break;
+            case OP_TRUE:
+                shadow_push(&r, TRUE_VAL, constant(&r, TRUE_VAL));
+                ip++;
+                break;
+            case OP_FALSE:
+                shadow_push(&r, FALSE_VAL, constant(&r, FALSE_VAL));
+                ip++;
+                break;
+            case OP_POP:
+                shadow_pop(&r);
+                ip++;
+                break;
+            case OP_GET_LOCAL:
+                get_local(&r, ip[1]);
+                ip += 2;
+                break;
+            case OP_SET_LOCAL:
+                set_local(&r, ip[1]);
+                ip += 2;
+                break;
+            case OP_SET_LOCAL_POP:
+                set_local(&r, ip[1]);
+                shadow_pop(&r);
+                ip += 2;
+                break;
+            case OP_GET_LOCAL_LONG:
+                get_local(&r, short_operand(ip));
+                ip += 3;
+                break;
+            case OP_SET_LOCAL_LONG:
+                set_local(&r, short_operand(ip));
+                ip += 3;
+                break;
+            case OP_GET_GLOBAL:
+                get_global(&r, short_operand(ip));
+                ip += 3;
+                break;
+            case OP_SET_GLOBAL:
+                set_global(&r, short_operand(ip));
+                ip += 3;
+                break;
+            case OP_ADD: case OP_ADD_NUM: case OP_ADD_STR:
+                arith(&r, IR_ADD);
+                ip++;
+                break;
+            case OP_SUBTRACT:
+                arith(&r, IR_SUBTRACT);
+                ip++;
+                break;
+            case OP_MULTIPLY:
+                arith(&r, IR_MULTIPLY);
+                ip++;
+                break;
+            case OP_DIVIDE:
+                arith(&r, IR_DIVIDE);
+                ip++;
+                break;
+            case OP_LESS: case OP_LESS_NUM:
+                compare(&r, IR_LESS);
+                ip++;
+                break;
+            case OP_GREATER: case OP_GREATER_NUM:
+                compare(&r, IR_GREATER);
+                ip++;
+                break;
+            case OP_EQUAL:
+                equal(&r);
+                ip++;
+                break;
+            case OP_NEGATE:
+                negate(&r);
+                ip++;
+                break;
+            case OP_NOT:
+                logical_not(&r);
+                ip++;
+                break;
+            case OP_ADD_LOCALS:
+                get_local(&r, ip[1]);
+                get_local(&r, ip[2]);
+                arith(&r, IR_ADD);
+                ip += 3;
+                break;
+            case OP_ADD_LOCAL_CONST:
+                get_local(&r, ip[1]);
+                shadow_push(&r, r.constants[ip[2]], constant(&r, r.constants[ip[2]]));
+                arith(&r, IR_ADD);
+                ip += 3;
+                break;
+            case OP_LESS_LOCAL_CONST:
+                get_local(&r, ip[1]);
+                shadow_push(&r, r.constants[ip[2]], constant(&r, r.constants[ip[2]]));
+                compare(&r, IR_LESS);
+                ip += 3;
+                break;
+            case OP_JUMP:
+                ip += 3 + short_operand(ip);
+                break;
+            case OP_JUMP_IF_FALSE:
+                ip = jump_if_false(&r, ip + 3, ip + 3 + short_operand(ip));
+                break;
+            case OP_LOOP:
+                ip += 3 - short_operand(ip);
+                /* back at the header with the stack as it started */
+                if(ip == header)
+                    return !r.failed && r.depth == rec->base && rec->count > 0;
+                break;
+            default:
+                /* calls, closures, upvalues, printing, and loops that
+                 * already have a trace */
+                return false;
+        }
+    }
+    return false;
+}
+
+#endif
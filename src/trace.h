@@ -0,0 +1,85 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "chunk.h"
+
+/* a trace is one iteration of a hot loop, recorded as the path it
+ * actually takes through the bytecode. it is a straight line of typed
+ * instructions: every value is unboxed to the type it had while
+ * recording, loads check that it still has it and every branch becomes
+ * a guard. a failing check leaves the trace through a snapshot, which
+ * tells how to rebuild the interpreter's stack at that point */
+
+/* instructions, snapshots and stack entries a trace can hold */
+#define TRACE_MAX 256
+#define TRACE_REFS 4096
+/* bytecode instructions recorded before giving up on a loop */
+#define TRACE_STEPS 1024
+
+typedef enum {
+    TYPE_INT,   // int64_t
+    TYPE_NUM,   // double
+    TYPE_BOOL,  // 0 or 1
+    TYPE_NIL
+} trace_type;
+
+typedef enum {
+    IR_CONST,        // value
+    IR_LOAD_SLOT,    // slot a, checked to hold the type
+    IR_LOAD_GLOBAL,  // global slot a, checked to hold the type
+    IR_CHECK_GLOBAL, // global slot a is defined
+    IR_STORE_SLOT,   // slot a = b
+    IR_STORE_GLOBAL, // global slot a = b
+    IR_ADD,          // a + b in the type, ints leave on overflow
+    IR_SUBTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,       // ints leave unless the division is exact
+    IR_NEGATE,
+    IR_NOT,          // a is a bool
+    IR_LESS,         // a < b as ints when both are, as doubles otherwise
+    IR_GREATER,
+    IR_EQUAL,
+    IR_GUARD_TRUE,   // leave unless a is true
+    IR_GUARD_FALSE
+} ir_op;
+
+typedef struct {
+    uint8_t op;
+    uint8_t type;   // of the result
+    int a;
+    int b;
+    Val value;
+    /* the snapshot to leave through, -1 for an op that can't fail */
+    int exit;
+} ir_inst;
+
+/* run() resumes at pc with depth values on the frame's stack. the ones
+ * below the loop's base are in the slots already, the ones above it are
+ * depth - base refs from refs on */
+typedef struct {
+    uint8_t *pc;
+    int depth;
+    int refs;
+} snapshot;
+
+typedef struct trace_recording {
+    ir_inst ir[TRACE_MAX];
+    int count;
+    snapshot snapshots[TRACE_MAX];
+    int snapshot_count;
+    int refs[TRACE_REFS];
+    int ref_count;
+    /* values on the frame's stack at the loop header */
+    int base;
+} trace_recording;
+
+struct call_frame;
+
+/* record the iteration the loop starting at header is about to run.
+ * nothing is executed, the recorder follows the values on a copy of
+ * the stack. false for a path through anything but numbers, bools and
+ * nil in locals and globals, arithmetic, comparisons and jumps */
+bool record_trace(trace_recording *recording, struct call_frame *frame,
+                  Val *sp, uint8_t *header);
+
+#endif
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -14,37 +15,84 @@ void init_val_array(val_array *array) {
 void write_val_array(val_array *array, Val value){
     if(array->capacity < array->count + 1) {
         int old_capacity = array->capacity;
-        array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(Val, array->values, old_capacity, array->capacity);
+        int capacity = GROW_CAPACITY(old_capacity);
+        /* no realloc in place, a concurrent marking thread may still
+         * be reading the old array. copy it and swap under the lock */
+        Val *values = ALLOCATE(Val, capacity);
+        if(array->count > 0)
+            memcpy(values, array->values, sizeof(Val) * array->count);
+        Val *old = array->values;
+        gc_lock();
+        array->values = values;
+        array->capacity = capacity;
+        gc_unlock();
+        FREE_ARRAY(Val, old, old_capacity);
     }
-    array->values[array->count++] = value;
+    gc_lock();
+    array->values[array->count] = value;
+    array->count++;
+    gc_unlock();
 }
 
 void print_val(Val value){
+#ifdef NAN_BOXING
+    if(IS_BOOL(value))
+        printf(AS_BOOL(value) ? "true" : "false");
+    else if(IS_NIL(value))
+        printf("nil");
+    else if(IS_INT(value))
+        printf("%" PRId64, AS_INT(value));
+    else if(IS_DOUBLE(value))
+        printf("%g", AS_DOUBLE(value));
+    else if(IS_OBJ(value))
+        print_object(value);
+    else if(IS_UNDEFINED(value))
+        printf("undefined");
+#else
     switch(value.type) {
         case VAL_BOOL :
             printf(AS_BOOL(value) ? "true" : "false");
             break;
         case VAL_NIL: printf("nil"); break;
         case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_INT: printf("%" PRId64, AS_INT(value)); break;
         case VAL_OBJ: print_object(value); break;
+        case VAL_UNDEFINED: printf("undefined"); break;
     }
+#endif
 }
 
 bool is_equal(Val a, Val b) {
+#ifdef NAN_BOXING
+    /* NaN != NaN and 1 == 1.0, so doubles can't be compared bitwise.
+     * every other value is identical to its bits, strings being
+     * interned and ropes flattened by the caller */
+    if(IS_DOUBLE(a) || IS_DOUBLE(b))
+        return IS_NUMERIC(a) && IS_NUMERIC(b) && as_numeric(a) == as_numeric(b);
+    /* boxed integers are equal by value */
+    if(IS_BIG_INT(a) && IS_BIG_INT(b))
+        return AS_BIG_INT(a) == AS_BIG_INT(b);
+    return a == b;
+#else
+    /* 1 and 1.0 are the same number */
+    if(IS_NUMBER(a) && IS_NUMBER(b) && a.type != b.type)
+        return AS_NUMBER(a) == AS_NUMBER(b);
     if(a.type != b.type) return false;
 
     switch(a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_INT:    return AS_INT(a) == AS_INT(b);
                          /* handle equality of strings */
         case VAL_OBJ:   
+                         /* strings are interned, ropes flattened by the caller */
                          /* print_val(a); */
                          /* print_val(b); */
                          return AS_OBJ(a) == AS_OBJ(b);
         default: return false;
     }
+#endif
 }
 
 
@@ -21,13 +21,84 @@ typedef struct obj_string obj_string; //payload for the string class
  * Following are data types with in-built support
  * */
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+/* a double whose exponent bits are all set and whose quiet bit is set
+ * is a NaN the hardware never produces by itself. every other value is
+ * stored in the 51 bits of payload left in such a NaN:
+ * the sign bit set means an Obj pointer in the low 48 bits,
+ * otherwise INT_TAG means a 48 bit integer in the low 48 bits,
+ * otherwise the low two bits tell nil, false and true apart
+ * */
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+#define INT_TAG  ((uint64_t)0x0002000000000000)
+#define INT_BITS ((uint64_t)0x0000ffffffffffff)
+
+#define TAG_NIL   1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+/* never seen by programs, marks a global slot whose variable isn't defined yet */
+#define TAG_UNDEFINED 4
+
+/* integers outside of this range are boxed, see integer_val() */
+#define VAL_INT_MIN (-((int64_t)1 << 47))
+#define VAL_INT_MAX (((int64_t)1 << 47) - 1)
+
+typedef uint64_t Val;
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_DOUBLE(value)  (((value) & QNAN) != QNAN)
+#define IS_INT(value)     (((value) & (SIGN_BIT | QNAN | INT_TAG)) == (QNAN | INT_TAG))
+#define IS_OBJ(value)     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)     ((value) == TRUE_VAL)
+#define AS_DOUBLE(value)   val_to_num(value)
+/* shift the 48 bits up and back down to sign extend them */
+#define AS_INT(value)      ((int64_t)((value) << 16) >> 16)
+#define AS_OBJ(value)      ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define AS_NATIVE(value)   (((obj_native*)AS_OBJ(value))->function)
+
+#define BOOL_VAL(b)        ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL          ((Val)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL           ((Val)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL            ((Val)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL      ((Val)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num)    num_to_val(num)
+#define INT_VAL(i)         ((Val)(QNAN | INT_TAG | ((uint64_t)(i) & INT_BITS)))
+#define OBJ_VAL(obj)       (Val)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+/* type punning through memcpy, compilers turn it into a plain move */
+static inline double val_to_num(Val value) {
+    double num;
+    memcpy(&num, &value, sizeof(Val));
+    return num;
+}
+
+static inline Val num_to_val(double num) {
+    Val value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    VAL_INT,
     VAL_OBJ,    //hold heap allocated objects
+    VAL_UNDEFINED,  //a global slot whose variable isn't defined yet
 } value_type;
 
+#define VAL_INT_MIN INT64_MIN
+#define VAL_INT_MAX INT64_MAX
+
 /* Here is the tagged-union!
  * A union allowws reuse of bits, allowing to optimize the language in terms of space.
  * HOWEVER, it is unsafe to use! it is easy to access the same bit many
@@ -39,6 +110,7 @@ typedef struct{
     union {
         bool boolean;
         double number;
+        int64_t integer;
         Obj *obj;
     } as;   // Q/A: why did I use the name `as`?
 } Val;
@@ -49,12 +121,15 @@ typedef struct{
  * */
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
-#define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#define IS_DOUBLE(value)  ((value).type == VAL_NUMBER)
+#define IS_INT(value)     ((value).type == VAL_INT)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
 /* unpack the union */
 #define AS_BOOL(value)     ((value).as.boolean)
-#define AS_NUMBER(value)   ((value).as.number)
+#define AS_DOUBLE(value)   ((value).as.number)
+#define AS_INT(value)      ((value).as.integer)
 #define AS_OBJ(value)      ((value).as.obj)
 #define AS_NATIVE(value)   (((obj_native*)AS_OBJ(value))->function)
 
@@ -63,10 +138,22 @@ typedef struct{
 /* convert C's static types to dynamic types in cpplox */
 #define BOOL_VAL(value)    ((Val){VAL_BOOL,   {.boolean = value}})
 #define NIL_VAL            ((Val){VAL_NIL,    {.number = 0}})
+#define UNDEFINED_VAL      ((Val){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value)  ((Val){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)     ((Val){VAL_INT,    {.integer = value}})
 /* take a bare Obj pointer. Wrap it in a Val */
 #define OBJ_VAL(object)     ((Val) {VAL_OBJ, {.obj = (Obj*)object}})
 
+#endif
+
+/* numbers are doubles or integers, the language doesn't tell them apart.
+ * AS_NUMBER reads either as a double */
+#define IS_NUMBER(value)  (IS_INT(value) || IS_DOUBLE(value))
+#define AS_NUMBER(value)  number_as_double(value)
+
+static inline double number_as_double(Val value) {
+    return IS_INT(value) ? (double)AS_INT(value) : AS_DOUBLE(value);
+}
 
 /*
  * Constant pool is an array of values, and should be stored as such in the compiled class
@@ -1,18 +1,25 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
+#include "trace.h"
 #include "vm.h"
 
 /* Global decl */
 VM vm;
 
+/* a stack trace shows this many of the innermost and the outermost
+ * frames, the ones in between are only counted */
+#define TRACE_EDGE 16
+
 static void reset_stack() {
   vm.stack_top = vm.stack; // set stack_top to the beginning of the array to
 			   // indecate it is empty
@@ -33,6 +40,10 @@ static void runtime_error(const char *format, ...) {
   /* fprintf(stderr, "line [%d] in script\n", lines); */
 
   for (int i = vm.frame_count - 1; i >= 0; i--) {
+    if (i == vm.frame_count - 1 - TRACE_EDGE && i >= TRACE_EDGE) {
+      fprintf(stderr, "... %d more frames\n", i - TRACE_EDGE + 1);
+      i = TRACE_EDGE - 1;
+    }
     call_frame *frame = &vm.frame[i];
     obj_function *function = frame->closure->function;
     size_t inst = frame->ip - function->chunk.code - 1;
@@ -52,10 +63,27 @@ static Val native_clock(int argcount, Val *args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+static Val native_heap_census(int argcount, Val *args) {
+  print_heap_census(stderr);
+  return NIL_VAL;
+}
+
+/* heap_dump(path) returns whether the dump could be written */
+static Val native_heap_dump(int argcount, Val *args) {
+  if (argcount != 1 || !IS_TEXT(args[0]))
+    return BOOL_VAL(false);
+  /* args live on the stack, the rope stays reachable meanwhile */
+  if (IS_ROPE(args[0]))
+    args[0] = OBJ_VAL(flatten_rope(AS_ROPE(args[0])));
+  return BOOL_VAL(dump_heap(AS_CSTRING(args[0])));
+}
+
 static void native_define(const char *name, native function) {
   push(OBJ_VAL(copy_string(name, (int)(strlen(name)))));
   push(OBJ_VAL(new_native(function)));
-  set_table(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = global_slot(AS_STRING(vm.stack[0]));
+  vm.global_values.values[slot] = vm.stack[1];
+  root_write_barrier(vm.stack[1]);
   pop();
   pop();
 }
@@ -65,18 +93,65 @@ static void native_define(const char *name, native function) {
  */
 
 void init_vm() {
+  vm.frame_capacity = FRAMES_INIT;
+  vm.frame = malloc(sizeof(call_frame) * vm.frame_capacity);
+  vm.stack_capacity = STACK_INIT;
+  vm.stack = malloc(sizeof(Val) * vm.stack_capacity);
+  if (vm.frame == NULL || vm.stack == NULL)
+    exit(1);
+  vm.max_frames = FRAMES_MAX;
+  vm.max_stack = STACK_MAX;
+  vm.jit_threshold = JIT_THRESHOLD;
+  vm.trace_threshold = TRACE_THRESHOLD;
+  memset(vm.loop_hits, 0, sizeof(vm.loop_hits));
   reset_stack();
   /*No objects on the heap at the moment*/
   vm.objects = NULL;
-  init_table(&vm.globals);
+  vm.young_objects = NULL;
+  vm.young_bytes = 0;
+  vm.remembered_count = 0;
+  vm.remembered_capacity = 0;
+  vm.remembered = NULL;
+  vm.young_string_count = 0;
+  vm.young_string_capacity = 0;
+  vm.young_strings = NULL;
+  vm.bytes_allocated = 0;
+  vm.next_gc = 1024 * 1024;
+  vm.max_heap = 0;
+  vm.oom_handler = NULL;
+  vm.gray_count = 0;
+  vm.gray_capacity = 0;
+  vm.gray_stack = NULL;
+  vm.gc_incremental = false;
+  vm.gc_concurrent = false;
+  vm.gc_step_budget = GC_DEFAULT_STEP_BUDGET;
+  vm.gc_state = GC_IDLE;
+  vm.gc_step_debt = 0;
+  memset(vm.gc_pauses, 0, sizeof(vm.gc_pauses));
+  vm.gc_max_pause_ns = 0;
+  vm.gc_total_pause_ns = 0;
+  init_table(&vm.global_slots);
+  init_val_array(&vm.global_names);
+  init_val_array(&vm.global_values);
   init_table(&vm.strings);
   native_define("clock", native_clock);
+  native_define("heap_census", native_heap_census);
+  native_define("heap_dump", native_heap_dump);
 }
 
 void free_vm() {
-  free_table(&vm.globals);
+  free_table(&vm.global_slots);
+  free_val_array(&vm.global_names);
+  free_val_array(&vm.global_values);
   free_table(&vm.strings);
   free_objects();
+  free(vm.frame);
+  free(vm.stack);
+  vm.frame = NULL;
+  vm.stack = NULL;
+#ifdef DEBUG_PROFILE_OPS
+  print_opcode_profile(stderr);
+#endif
 }
 
 void push(Val value) {
@@ -89,6 +164,24 @@ Val pop() {
   return *vm.stack_top;
 }
 
+/* the slot of the global variable name, a new undefined one the first
+ * time the name is seen */
+int global_slot(obj_string *name) {
+  Val slot;
+  if (get_table(&vm.global_slots, name, &slot))
+    return (int)AS_INT(slot);
+
+  /* growing the arrays may collect before the name is stored */
+  push(OBJ_VAL(name));
+  int index = vm.global_values.count;
+  write_val_array(&vm.global_names, OBJ_VAL(name));
+  root_write_barrier(OBJ_VAL(name));
+  write_val_array(&vm.global_values, UNDEFINED_VAL);
+  set_table(&vm.global_slots, name, INT_VAL(index));
+  pop();
+  return index;
+}
+
 static Val peek(int distance) {
   /* returns how far from the stack top to search.
    * 0 is the top, -1 is the second down, and so on
@@ -96,6 +189,73 @@ static Val peek(int distance) {
   return vm.stack_top[-1 - distance];
 }
 
+#ifdef REGISTER_VM
+static bool run_registers(call_frame *frame);
+#endif
+
+/* room for one more frame, false once vm.max_frames are in use */
+static bool grow_frames() {
+  if (vm.frame_count < vm.frame_capacity)
+    return true;
+  if (vm.frame_count >= vm.max_frames)
+    return false;
+  int capacity = vm.frame_capacity * 2;
+  if (capacity > vm.max_frames)
+    capacity = vm.max_frames;
+  call_frame *frames = realloc(vm.frame, sizeof(call_frame) * capacity);
+  if (frames == NULL)
+    return false;
+  vm.frame = frames;
+  vm.frame_capacity = capacity;
+  return true;
+}
+
+/* room for count more values above the stack top, false once the stack
+ * would outgrow vm.max_stack. the stack moves, so every pointer into it
+ * is moved along: the top, the frames' slots and the open upvalues */
+static bool grow_stack(int count) {
+  int needed = (int)(vm.stack_top - vm.stack) + count;
+  if (needed <= vm.stack_capacity)
+    return true;
+  size_t capacity = vm.stack_capacity;
+  while (capacity < (size_t)needed)
+    capacity *= 2;
+  if (capacity > vm.max_stack / sizeof(Val))
+    capacity = vm.max_stack / sizeof(Val);
+  if (capacity < (size_t)needed)
+    return false;
+
+  Val *stack = malloc(sizeof(Val) * capacity);
+  if (stack == NULL)
+    return false;
+  Val *old = vm.stack;
+  memcpy(stack, old, sizeof(Val) * (vm.stack_top - old));
+  for (int i = 0; i < vm.frame_count; i++)
+    vm.frame[i].slots = stack + (vm.frame[i].slots - old);
+  for (obj_upvalue *upvalue = vm.open_upvalue; upvalue != NULL;
+       upvalue = upvalue->next)
+    upvalue->location = stack + (upvalue->location - old);
+  vm.stack_top = stack + (vm.stack_top - old);
+  vm.stack = stack;
+  vm.stack_capacity = (int)capacity;
+  free(old);
+  return true;
+}
+
+#if defined(JIT) || defined(REGISTER_VM)
+/* with tracing on, functions with loops stay on the stack, where their
+ * loops are traced once they get hot */
+static bool runs_registers(obj_function *function) {
+#ifdef TRACE_JIT
+  if (function->registers != NULL && function->registers->loops)
+    return vm.trace_threshold == 0;
+#endif
+  return function->registers != NULL;
+}
+#endif
+
+/* the stack only grows here, callers reload anything they cached from
+ * vm.stack_top and the frames afterwards */
 static bool call(obj_closure *closure, int arg_count) {
   if (closure->function->arity != arg_count) {
     runtime_error("expected %d args, but got %d", closure->function->arity,
@@ -103,15 +263,30 @@ static bool call(obj_closure *closure, int arg_count) {
     return false;
   }
 
-  if (vm.frame_count == FRAMES_MAX) {
+  /* the compiler counted the most values the frame holds, the callee
+   * and args already on the stack among them */
+  if (!grow_frames() ||
+      !grow_stack(closure->function->max_stack + FRAME_SLACK)) {
     runtime_error("Stack overflow!");
     return false;
   }
 
+#ifdef JIT
+  obj_function *function = closure->function;
+  if (function->jit == NULL && function->aot == NULL &&
+      !runs_registers(function) && vm.jit_threshold > 0 &&
+      ++function->calls == vm.jit_threshold)
+    function->jit = jit_compile(&function->chunk);
+#endif
+
   call_frame *frame = &vm.frame[vm.frame_count++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
   frame->slots = vm.stack_top - arg_count - 1;
+#ifdef REGISTER_VM
+  if (runs_registers(closure->function))
+    return run_registers(frame);
+#endif
   return true;
 }
 
@@ -160,267 +335,1136 @@ static obj_upvalue *capture_upvalue(Val *local) {
   return upval;
 }
 
+/* fill in the upvalues of closure, just made by the CLOSURE op whose
+ * captures start at ip. returns the op after them */
+static uint8_t *capture_upvalues(obj_closure *closure, call_frame *frame,
+				 uint8_t *ip, bool wide) {
+  for (int i = 0; i < closure->upvalue_count; ++i) {
+    uint8_t loc = *ip++;
+    int index = *ip++;
+    if (wide)
+      index = (index << 8) | *ip++;
+
+    /* capturing may have promoted the closure already */
+    if (loc)
+      STORE_REF(closure, closure->upvalues[i],
+		capture_upvalue(frame->slots + index));
+    else
+      STORE_REF(closure, closure->upvalues[i],
+		frame->closure->upvalues[index]);
+  }
+  return ip;
+}
+
 static bool is_false(Val value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-  obj_string *b = AS_STRING(pop());
-  obj_string *a = AS_STRING(pop());
+static int text_length(Val value) {
+  return IS_ROPE(value) ? AS_ROPE(value)->length : AS_STRING(value)->length;
+}
 
-  /* calculate the new length */
-  int new_length = a->length + b->length;
-  char *new_chars = ALLOCATE(char, new_length + 1);
-  memcpy(new_chars, a->chars, a->length);
-  memcpy(new_chars + a->length, b->chars, b->length);
-  new_chars[new_length] = '\0';
+/* replace a rope on the stack with its flat string, it stays
+ * reachable from there while flattening allocates */
+static void flatten_operand(int distance) {
+  if (IS_ROPE(peek(distance)))
+    vm.stack_top[-1 - distance] =
+	OBJ_VAL(flatten_rope(AS_ROPE(peek(distance))));
+}
 
-  obj_string *result = take_string(new_chars, new_length);
+/* false, with the operands left alone, if the result would be longer
+ * than an int can count */
+static bool concatenate() {
+  /* leave the operands on the stack until the result exists, so a
+   * collection triggered by the allocation below cannot free them */
+  int64_t total = (int64_t)text_length(peek(0)) + text_length(peek(1));
+  if (total > INT_MAX)
+    return false;
+  int length = (int)total;
+  if (length >= ROPE_MIN_LENGTH) {
+    /* long results are only copied once something needs their chars */
+    obj_rope *rope = new_rope(AS_OBJ(peek(1)), AS_OBJ(peek(0)), length);
+    pop();
+    pop();
+    push(OBJ_VAL(rope));
+    return true;
+  }
+
+  /* ropes are never shorter than the result */
+  obj_string *b = AS_STRING(peek(0));
+  obj_string *a = AS_STRING(peek(1));
+
+  /* build the result in place, interning may still swap in an
+   * existing copy */
+  obj_string *result = new_string(a->length + b->length);
+  memcpy(result->chars, a->chars, a->length);
+  memcpy(result->chars + a->length, b->chars, b->length);
+  result = intern_string(result);
+  pop();
+  pop();
   push(OBJ_VAL(result));
+  return true;
 }
+
+/* a op b on the two numbers on top of the stack. integers of any
+ * width stay exact while the result fits in 64 bits, past that or when
+ * either operand is a double the result is a double. a wide integer
+ * result is boxed while the operands are still on the stack */
+static void number_op(uint8_t op) {
+  Val a = peek(1);
+  Val b = peek(0);
+  if (IS_INTEGER(a) && IS_INTEGER(b)) {
+    int64_t x = as_integer(a);
+    int64_t y = as_integer(b);
+    int64_t result = 0;
+    bool overflows = true;
+    switch (op) {
+    case OP_ADD:
+      overflows = __builtin_add_overflow(x, y, &result);
+      break;
+    case OP_SUBTRACT:
+      overflows = __builtin_sub_overflow(x, y, &result);
+      break;
+    case OP_MULTIPLY:
+      overflows = __builtin_mul_overflow(x, y, &result);
+      break;
+    case OP_DIVIDE:
+      overflows = y == 0 || y == -1 || x % y != 0;
+      if (!overflows)
+	result = x / y;
+      break;
+    case OP_LESS:
+      pop();
+      vm.stack_top[-1] = BOOL_VAL(x < y);
+      return;
+    case OP_GREATER:
+      pop();
+      vm.stack_top[-1] = BOOL_VAL(x > y);
+      return;
+    }
+    if (!overflows) {
+      Val value = integer_val(result);
+      pop();
+      vm.stack_top[-1] = value;
+      return;
+    }
+  }
+
+  double x = as_numeric(a);
+  double y = as_numeric(b);
+  Val value = NIL_VAL;
+  switch (op) {
+  case OP_ADD:      value = NUMBER_VAL(x + y); break;
+  case OP_SUBTRACT: value = NUMBER_VAL(x - y); break;
+  case OP_MULTIPLY: value = NUMBER_VAL(x * y); break;
+  case OP_DIVIDE:   value = NUMBER_VAL(x / y); break;
+  case OP_LESS:     value = BOOL_VAL(x < y); break;
+  case OP_GREATER:  value = BOOL_VAL(x > y); break;
+  }
+  pop();
+  vm.stack_top[-1] = value;
+}
+
+/* negate the number on top of the stack, as number_op() would */
+static void negate_number() {
+  Val a = peek(0);
+  Val value;
+  if (IS_INTEGER(a) && as_integer(a) != INT64_MIN)
+    value = integer_val(-as_integer(a));
+  else
+    value = NUMBER_VAL(-as_numeric(a));
+  vm.stack_top[-1] = value;
+}
+
 static void close_upvalues(Val *last) {
   while (vm.open_upvalue != NULL && vm.open_upvalue->location >= last) {
     obj_upvalue *value = vm.open_upvalue;
-    value->closed = *value->location;
+    STORE_VAL(value, value->closed, *value->location);
     value->location = &value->closed;
     vm.open_upvalue = value->next;
   }
 }
 
+#ifdef TRACE_JIT
+static loop_trace *find_trace(obj_function *function, uint8_t *header) {
+  int offset = (int)(header - function->chunk.code);
+  for (loop_trace *trace = function->traces; trace != NULL;
+       trace = trace->next)
+    if (trace->header == offset)
+      return trace;
+  return NULL;
+}
+
+/* the back edge at loop took frame->ip to its header often enough:
+ * record the iteration about to start and compile it. the back edge
+ * becomes LOOP_TRACE once there is a trace to run, or never will be */
+static void hot_loop(call_frame *frame, uint8_t *loop) {
+  static trace_recording recording;
+  obj_function *function = frame->closure->function;
+  loop_trace *trace = find_trace(function, frame->ip);
+  if (trace == NULL) {
+    trace = ALLOCATE(loop_trace, 1);
+    trace->header = (int)(frame->ip - function->chunk.code);
+    trace->code = NULL;
+    trace->size = 0;
+    trace->attempts = 0;
+    trace->misses = 0;
+    trace->iterations = 0;
+    trace->next = function->traces;
+    function->traces = trace;
+  }
+  if (record_trace(&recording, frame, vm.stack_top, frame->ip) &&
+      compile_trace(trace, &recording))
+    *loop = OP_LOOP_TRACE;
+  else if (++trace->attempts == TRACE_ATTEMPTS)
+    *loop = OP_LOOP_TRACE;
+}
+
+/* run the trace of the loop whose header frame->ip is at. one that
+ * keeps leaving before it finishes an iteration was recorded with types
+ * the loop has moved on from, its back edge goes back to counting so
+ * that it is recorded again */
+static Val *enter_trace(call_frame *frame, uint8_t *loop, Val *sp) {
+  loop_trace *trace = find_trace(frame->closure->function, frame->ip);
+  if (trace->code == NULL)
+    return sp;
+  sp = trace_run(trace, frame);
+  if (trace->iterations > 0) {
+    trace->misses = 0;
+  } else if (++trace->misses == TRACE_MISSES) {
+    discard_trace(trace);
+    if (++trace->attempts < TRACE_ATTEMPTS)
+      *loop = OP_LOOP;
+  }
+  return sp;
+}
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_instruction(call_frame *frame) {
+  printf("       ");
+  for (Val *slot = vm.stack; slot < vm.stack_top; slot++) {
+    printf("[ ");
+    print_val(*slot);
+    printf(" ]");
+  }
+  printf("\n");
+  disassembleInstruction(
+      &frame->closure->function->chunk,
+      (int)(frame->ip - frame->closure->function->chunk.code));
+}
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+    SAVE_STATE();                                                              \
+    trace_instruction(frame);                                                  \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION()
+#endif
+
+#ifdef DEBUG_PROFILE_OPS
+#define PROFILE_INSTRUCTION() profile_opcode(*ip)
+#else
+#define PROFILE_INSTRUCTION()
+#endif
+
 static interpreted_result run(void) {
-  call_frame *frame = &vm.frame[vm.frame_count - 1];
-#define READ_BYTE() (*frame->ip++)
+  /* the hot state lives in locals the compiler can keep in registers.
+   * it is written back to the frame and vm.stack_top before anything
+   * that may allocate, call out or report an error, and reloaded after */
+  call_frame *frame;
+  uint8_t *ip;
+  Val *sp;
+  Val *slots;
+#define SAVE_STATE()                                                           \
+  do {                                                                         \
+    frame->ip = ip;                                                            \
+    vm.stack_top = sp;                                                         \
+  } while (false)
+#define LOAD_STATE()                                                           \
+  do {                                                                         \
+    frame = &vm.frame[vm.frame_count - 1];                                     \
+    ip = frame->ip;                                                            \
+    sp = vm.stack_top;                                                         \
+    slots = frame->slots;                                                      \
+  } while (false)
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    SAVE_STATE();                                                              \
+    runtime_error(__VA_ARGS__);                                                \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+#define READ_BYTE() (*ip++)
 #define READ_CONSTANT()                                                        \
   (frame->closure->function->chunk.constants.values[READ_BYTE()])
   /* read a single byte constant from the bytecode chunk */
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define BIN_OP(v, op)                                                          \
+  (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+  /* the 24 bit constant index of a wide op */
+#define READ_CONSTANT_LONG()                                                   \
+  (ip += 3, frame->closure->function->chunk.constants                          \
+		.values[(ip[-3] << 16) | (ip[-2] << 8) | ip[-1]])
+  /* anything the integer fast paths leave over. doubles are done here,
+   * two integers go to number_op() which may box the result */
+#define BIN_OP(v, op, opcode)                                                  \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtime_error("operands must be numbers.");                              \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    if (!IS_NUMERIC(PEEK(0)) || !IS_NUMERIC(PEEK(1)))                          \
+      RUNTIME_ERROR("operands must be numbers.");                              \
+    if (IS_DOUBLE(PEEK(0)) || IS_DOUBLE(PEEK(1))) {                            \
+      double b = as_numeric(POP());                                            \
+      double a = as_numeric(POP());                                            \
+      PUSH(v(a op b));                                                         \
+    } else {                                                                   \
+      SAVE_STATE();                                                            \
+      number_op(opcode);                                                       \
+      sp = vm.stack_top;                                                       \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(v(a op b));                                                           \
   } while (false) // Execute only once
+  /* integers stay exact while the result fits, doubles take over after */
+#define ARITH_OP(overflows, op, opcode)                                        \
+  do {                                                                         \
+    int64_t result;                                                            \
+    if (IS_INT(PEEK(0)) && IS_INT(PEEK(1)) &&                                  \
+	!overflows(AS_INT(PEEK(1)), AS_INT(PEEK(0)), &result) &&               \
+	result >= VAL_INT_MIN && result <= VAL_INT_MAX) {                      \
+      sp--;                                                                    \
+      sp[-1] = INT_VAL(result);                                                \
+    } else {                                                                   \
+      BIN_OP(NUMBER_VAL, op, opcode);                                          \
+    }                                                                          \
+  } while (false)
+#define COMPARE_OP(op, opcode)                                                 \
+  do {                                                                         \
+    if (IS_INT(PEEK(0)) && IS_INT(PEEK(1))) {                                  \
+      bool result = AS_INT(PEEK(1)) op AS_INT(PEEK(0));                        \
+      sp--;                                                                    \
+      sp[-1] = BOOL_VAL(result);                                               \
+    } else {                                                                   \
+      BIN_OP(BOOL_VAL, op, opcode);                                            \
+    }                                                                          \
+  } while (false)
+  /* a generic op rewrites itself to a specialized one once it sees
+   * operands that fit, which goes back to the generic one when they
+   * stop fitting */
+#ifdef QUICKENING
+#define QUICKEN(fits, quick)                                                   \
+  do {                                                                         \
+    if (fits)                                                                  \
+      ip[-1] = (quick);                                                        \
+  } while (false)
+#else
+#define QUICKEN(fits, quick)
+#endif
+#define DEOPTIMIZE(generic, handler)                                           \
+  do {                                                                         \
+    ip[-1] = (generic);                                                        \
+    goto handler;                                                              \
+  } while (false)
+#define NUMBER_OPERANDS() (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+#define FUSED_ADD(a, b)                                                        \
+  do {                                                                         \
+    int64_t result;                                                            \
+    if (!IS_INT(a) || !IS_INT(b) ||                                            \
+	__builtin_add_overflow(AS_INT(a), AS_INT(b), &result) ||               \
+	result < VAL_INT_MIN || result > VAL_INT_MAX) {                        \
+      PUSH(a);                                                                 \
+      PUSH(b);                                                                 \
+      goto op_add;                                                             \
+    }                                                                          \
+    PUSH(INT_VAL(result));                                                     \
+  } while (false)
+  /* a frame whose function has machine code, compiled ahead of time or
+   * by the jit, runs there until it hands back the next call, return
+   * or failing op */
+#ifdef JIT
+#define JIT_ENTER()                                                            \
+  do {                                                                         \
+    obj_function *entered = frame->closure->function;                          \
+    if (entered->aot != NULL) {                                                \
+      vm.stack_top = entered->aot(frame, sp);                                  \
+      LOAD_STATE();                                                            \
+    } else if (entered->jit != NULL) {                                         \
+      vm.stack_top = jit_run(entered->jit, frame, sp);                         \
+      LOAD_STATE();                                                            \
+    }                                                                          \
+  } while (false)
+#else
+#define JIT_ENTER()                                                            \
+  do {                                                                         \
+    if (frame->closure->function->aot != NULL) {                               \
+      vm.stack_top = frame->closure->function->aot(frame, sp);                 \
+      LOAD_STATE();                                                            \
+    }                                                                          \
+  } while (false)
+#endif
 
-  for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("       ");
-    for (Val *slot = vm.stack; slot < vm.stack_top; slot++) {
-      printf("[ ");
-      print_val(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(
-	&frame->closure->function->chunk,
-	(int)(frame->ip - frame->closure->function->chunk.code));
+#ifdef THREADED_DISPATCH
+  /* every handler jumps straight to the next one through this table,
+   * instead of going back to a single shared switch */
+  static void *dispatch_table[UINT8_COUNT] = {
+      [0 ... UINT8_MAX] = &&TARGET_UNKNOWN,
+      [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+      [OP_DEF_GLOBAL] = &&TARGET_OP_DEF_GLOBAL,
+      [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+      [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+      [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+      [OP_EQUAL] = &&TARGET_OP_EQUAL,
+      [OP_GREATER] = &&TARGET_OP_GREATER,
+      [OP_LESS] = &&TARGET_OP_LESS,
+      [OP_NIL] = &&TARGET_OP_NIL,
+      [OP_TRUE] = &&TARGET_OP_TRUE,
+      [OP_FALSE] = &&TARGET_OP_FALSE,
+      [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+      [OP_JUMP] = &&TARGET_OP_JUMP,
+      [OP_CALL] = &&TARGET_OP_CALL,
+      [OP_TAIL_CALL] = &&TARGET_OP_TAIL_CALL,
+      [OP_CLOSURE] = &&TARGET_OP_CLOSURE,
+      [OP_ADD] = &&TARGET_OP_ADD,
+      [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+      [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+      [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+      [OP_NOT] = &&TARGET_OP_NOT,
+      [OP_LOOP] = &&TARGET_OP_LOOP,
+      [OP_NEGATE] = &&TARGET_OP_NEGATE,
+      [OP_GET_UPVALUE] = &&TARGET_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&TARGET_OP_SET_UPVALUE,
+      [OP_PRINT] = &&TARGET_OP_PRINT,
+      [OP_POP] = &&TARGET_OP_POP,
+      [OP_RETURN] = &&TARGET_OP_RETURN,
+      [OP_ADD_LOCALS] = &&TARGET_OP_ADD_LOCALS,
+      [OP_ADD_LOCAL_CONST] = &&TARGET_OP_ADD_LOCAL_CONST,
+      [OP_LESS_LOCAL_CONST] = &&TARGET_OP_LESS_LOCAL_CONST,
+      [OP_SET_LOCAL_POP] = &&TARGET_OP_SET_LOCAL_POP,
+      [OP_ADD_NUM] = &&TARGET_OP_ADD_NUM,
+      [OP_ADD_STR] = &&TARGET_OP_ADD_STR,
+      [OP_GREATER_NUM] = &&TARGET_OP_GREATER_NUM,
+      [OP_LESS_NUM] = &&TARGET_OP_LESS_NUM,
+      [OP_LOOP_TRACE] = &&TARGET_OP_LOOP_TRACE,
+      [OP_CONSTANT_LONG] = &&TARGET_OP_CONSTANT_LONG,
+      [OP_GET_LOCAL_LONG] = &&TARGET_OP_GET_LOCAL_LONG,
+      [OP_SET_LOCAL_LONG] = &&TARGET_OP_SET_LOCAL_LONG,
+      [OP_GET_UPVALUE_LONG] = &&TARGET_OP_GET_UPVALUE_LONG,
+      [OP_SET_UPVALUE_LONG] = &&TARGET_OP_SET_UPVALUE_LONG,
+      [OP_CLOSURE_LONG] = &&TARGET_OP_CLOSURE_LONG,
+  };
+#define CASE(op) case op: TARGET_##op
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    PROFILE_INSTRUCTION();                                                     \
+    goto *dispatch_table[READ_BYTE()];                                         \
+  } while (false)
+#else
+#define CASE(op) case op
+#define DISPATCH() break
 #endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
+
+  LOAD_STATE();
+  JIT_ENTER();
+  for (;;) {
+    TRACE_INSTRUCTION();
+    PROFILE_INSTRUCTION();
+    switch (READ_BYTE()) {
+    CASE(OP_CONSTANT): {
       Val constant = READ_CONSTANT();
       /* print_val(constant); */
       /* printf("inside op constant"); */
-      push(constant);
-      break;
+      PUSH(constant);
+      DISPATCH();
     }
-    case OP_DEF_GLOBAL: {
+    CASE(OP_DEF_GLOBAL): {
       /* pretty self-explanatory?
        * do not check to see if the variable is already
        * defined, simply overwrite
        * */
-      obj_string *name = READ_STRING();
-      set_table(&vm.globals, name, peek(0));
-      pop();
-      break;
+      uint16_t slot = READ_SHORT();
+      SAVE_STATE();
+      vm.global_values.values[slot] = PEEK(0);
+      root_write_barrier(PEEK(0));
+      sp--;
+      DISPATCH();
     }
-    case OP_GET_GLOBAL: {
-      obj_string *name = READ_STRING();
-      Val value;
-      if (!get_table(&vm.globals, name, &value)) {
-	/* if you can't find the var, it's undefined */
-	runtime_error("undefined variable '%s in get_glob'.", name->chars);
-	return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_GET_GLOBAL): {
+      /* the compiler resolved the name to its slot */
+      uint16_t slot = READ_SHORT();
+      Val value = vm.global_values.values[slot];
+      if (IS_UNDEFINED(value)) {
+	/* the slot exists, the var was never defined */
+	RUNTIME_ERROR("undefined variable '%s in get_glob'.",
+		      AS_CSTRING(vm.global_names.values[slot]));
       }
-      push(value);
-      break;
+      PUSH(value);
+      DISPATCH();
     }
-    case OP_SET_GLOBAL: {
-      /* lookup in the constant table */
-      obj_string *name = READ_STRING();
-      if (set_table(&vm.globals, name, peek(0))) {
-	delete_table(&vm.globals, name);
-	runtime_error("Undefined variable %s in set_glob", name->chars);
-	return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_SET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      SAVE_STATE();
+      if (IS_UNDEFINED(vm.global_values.values[slot])) {
+	RUNTIME_ERROR("Undefined variable %s in set_glob",
+		      AS_CSTRING(vm.global_names.values[slot]));
       }
-      break;
+      vm.global_values.values[slot] = PEEK(0);
+      root_write_barrier(PEEK(0));
+      DISPATCH();
     }
-    case OP_GET_LOCAL: {
+    CASE(OP_GET_LOCAL): {
       uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
-      break;
+      PUSH(slots[slot]);
+      DISPATCH();
     }
-    case OP_SET_LOCAL: {
+    CASE(OP_SET_LOCAL): {
       uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
-      break;
+      slots[slot] = PEEK(0);
+      DISPATCH();
     }
+    CASE(OP_CONSTANT_LONG):
+      PUSH(READ_CONSTANT_LONG());
+      DISPATCH();
+    CASE(OP_GET_LOCAL_LONG):
+      PUSH(slots[READ_SHORT()]);
+      DISPATCH();
+    CASE(OP_SET_LOCAL_LONG):
+      slots[READ_SHORT()] = PEEK(0);
+      DISPATCH();
       /* add types for nil, true, false */
-    case OP_EQUAL: {
-      Val a = pop();
-      Val b = pop();
-      push(BOOL_VAL(is_equal(a, b)));
-      break;
+    CASE(OP_EQUAL): {
+      if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1))) {
+	SAVE_STATE();
+	flatten_operand(0);
+	flatten_operand(1);
+      }
+      Val a = POP();
+      Val b = POP();
+      PUSH(BOOL_VAL(is_equal(a, b)));
+      DISPATCH();
     }
-    case OP_GREATER:
-      BIN_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
-      BIN_OP(BOOL_VAL, <);
-      break;
-    case OP_NIL:
-      push(NIL_VAL);
-      break;
-    case OP_TRUE:
-      push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
-      push(BOOL_VAL(false));
-      break;
-    case OP_JUMP_IF_FALSE: {
+    CASE(OP_GREATER):
+      QUICKEN(NUMBER_OPERANDS(), OP_GREATER_NUM);
+    op_greater:
+      COMPARE_OP(>, OP_GREATER);
+      DISPATCH();
+    CASE(OP_LESS):
+      QUICKEN(NUMBER_OPERANDS(), OP_LESS_NUM);
+    op_less:
+      COMPARE_OP(<, OP_LESS);
+      DISPATCH();
+    CASE(OP_NIL):
+      PUSH(NIL_VAL);
+      DISPATCH();
+    CASE(OP_TRUE):
+      PUSH(BOOL_VAL(true));
+      DISPATCH();
+    CASE(OP_FALSE):
+      PUSH(BOOL_VAL(false));
+      DISPATCH();
+    CASE(OP_JUMP_IF_FALSE): {
       uint16_t offset = READ_SHORT();
-      if (is_false(peek(0)))
-	frame->ip += offset;
-      break;
+      if (is_false(PEEK(0)))
+	ip += offset;
+      DISPATCH();
     }
-    case OP_JUMP: {
+    CASE(OP_JUMP): {
       uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
+      ip += offset;
+      DISPATCH();
     }
-    case OP_CALL: {
+    CASE(OP_CALL): {
       int arg_count = READ_BYTE();
-      if (!call_val(peek(arg_count), arg_count))
+      SAVE_STATE();
+      if (!call_val(PEEK(arg_count), arg_count))
 	return INTERPRET_RUNTIME_ERROR;
-      frame = &vm.frame[vm.frame_count - 1];
-      break;
+      LOAD_STATE();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_CALL): {
+      int arg_count = READ_BYTE();
+      Val callee = PEEK(arg_count);
+      SAVE_STATE();
+      /* natives return here, the RETURN after this op passes it on */
+      if (!IS_CLOSURE(callee)) {
+	if (!call_val(callee, arg_count))
+	  return INTERPRET_RUNTIME_ERROR;
+	LOAD_STATE();
+	JIT_ENTER();
+	DISPATCH();
+      }
+      if (AS_CLOSURE(callee)->function->arity != arg_count)
+	RUNTIME_ERROR("expected %d args, but got %d",
+		      AS_CLOSURE(callee)->function->arity, arg_count);
+      /* the callee and its args take over this frame's slots, so
+       * tail recursion runs in constant stack space */
+      close_upvalues(slots);
+      memmove(slots, sp - arg_count - 1, (arg_count + 1) * sizeof(Val));
+      vm.stack_top = slots + arg_count + 1;
+      vm.frame_count--;
+      if (!call(AS_CLOSURE(callee), arg_count))
+	return INTERPRET_RUNTIME_ERROR;
+      LOAD_STATE();
+      JIT_ENTER();
+      DISPATCH();
     }
-    case OP_CLOSURE: {
+    CASE(OP_CLOSURE): {
       obj_function *function = AS_FUNCTION(READ_CONSTANT());
+      SAVE_STATE();
       obj_closure *closure = new_closure(function);
-      push(OBJ_VAL(closure));
-      for (int i = 0; i < closure->upvalue_count; ++i) {
-	uint8_t loc = READ_BYTE();
-	uint8_t index = READ_BYTE();
-
-	if (loc)
-	  closure->upvalues[i] = capture_upvalue(frame->slots + index);
-	else
-	  closure->upvalues[i] = frame->closure->upvalues[index];
-      }
-      break;
+      PUSH(OBJ_VAL(closure));
+      vm.stack_top = sp;
+      ip = capture_upvalues(closure, frame, ip, false);
+      DISPATCH();
+    }
+    CASE(OP_CLOSURE_LONG): {
+      obj_function *function = AS_FUNCTION(READ_CONSTANT_LONG());
+      SAVE_STATE();
+      obj_closure *closure = new_closure(function);
+      PUSH(OBJ_VAL(closure));
+      vm.stack_top = sp;
+      ip = capture_upvalues(closure, frame, ip, true);
+      DISPATCH();
     }
-    case OP_ADD: {
+    CASE(OP_ADD):
+      QUICKEN(NUMBER_OPERANDS(), OP_ADD_NUM);
+      QUICKEN(IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1)), OP_ADD_STR);
+    op_add: {
       /* check if string */
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-	concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-	double a = AS_NUMBER(pop());
-	double b = AS_NUMBER(pop());
-
-	push(NUMBER_VAL(a + b));
+      if (IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1))) {
+	SAVE_STATE();
+	if (!concatenate())
+	  RUNTIME_ERROR("String too long.");
+	sp = vm.stack_top;
+      } else if (IS_NUMERIC(PEEK(0)) && IS_NUMERIC(PEEK(1))) {
+	ARITH_OP(__builtin_add_overflow, +, OP_ADD);
       } else {
-	runtime_error("Operands to '+' must be two numbers or two strings");
-	return INTERPRET_RUNTIME_ERROR;
+	RUNTIME_ERROR("Operands to '+' must be two numbers or two strings");
       }
-      break;
+      DISPATCH();
     }
-    case OP_CLOSE_UPVALUE:
-      close_upvalues(vm.stack_top - 1);
-      pop();
-      break;
-    case OP_SUBTRACT:
-      BIN_OP(NUMBER_VAL, -);
-      break;
-    case OP_MULTIPLY:
-      BIN_OP(NUMBER_VAL, *);
-      break;
-    case OP_DIVIDE:
-      BIN_OP(NUMBER_VAL, /);
-      break;
-    case OP_NOT:
-      push(BOOL_VAL(is_false(pop())));
-      break;
-    case OP_LOOP: {
+    CASE(OP_CLOSE_UPVALUE):
+      close_upvalues(sp - 1);
+      sp--;
+      DISPATCH();
+    CASE(OP_SUBTRACT):
+      ARITH_OP(__builtin_sub_overflow, -, OP_SUBTRACT);
+      DISPATCH();
+    CASE(OP_MULTIPLY):
+      ARITH_OP(__builtin_mul_overflow, *, OP_MULTIPLY);
+      DISPATCH();
+    CASE(OP_DIVIDE): {
+      /* integers only divide to an integer when nothing is left over,
+       * 7 / 2 is still 3.5. dividing by -1 may overflow, leave it to
+       * the doubles */
+      if (IS_INT(PEEK(0)) && IS_INT(PEEK(1))) {
+	int64_t b = AS_INT(PEEK(0));
+	int64_t a = AS_INT(PEEK(1));
+	if (b != 0 && b != -1 && a % b == 0) {
+	  sp--;
+	  sp[-1] = INT_VAL(a / b);
+	  DISPATCH();
+	}
+      }
+      BIN_OP(NUMBER_VAL, /, OP_DIVIDE);
+      DISPATCH();
+    }
+    CASE(OP_NOT):
+      PEEK(0) = BOOL_VAL(is_false(PEEK(0)));
+      DISPATCH();
+    CASE(OP_LOOP): {
       uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+      ip -= offset;
+#ifdef TRACE_JIT
+      if (vm.trace_threshold > 0 &&
+	  ++vm.loop_hits[(uintptr_t)ip % HOT_LOOPS] >= vm.trace_threshold) {
+	vm.loop_hits[(uintptr_t)ip % HOT_LOOPS] = 0;
+	SAVE_STATE();
+	hot_loop(frame, ip + offset - 3);
+      }
+#endif
+      DISPATCH();
+    }
+    CASE(OP_LOOP_TRACE): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+#ifdef TRACE_JIT
+      SAVE_STATE();
+      sp = enter_trace(frame, ip + offset - 3, sp);
+      ip = frame->ip;
+#endif
+      DISPATCH();
     }
-    case OP_NEGATE:
+    CASE(OP_NEGATE):
       /* First check if the element at the top
        * of the stack is a number.
        * if not, runtime error
        * else, keep going
        * */
-      if (!IS_NUMBER(peek(0))) {
+      if (!IS_NUMERIC(PEEK(0))) {
 	//(TODO)
-	runtime_error("Operand must be a number.");
-	return INTERPRET_RUNTIME_ERROR;
+	RUNTIME_ERROR("Operand must be a number.");
       }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
-    case OP_GET_UPVALUE: {
+      if (IS_INT(PEEK(0)) && AS_INT(PEEK(0)) != VAL_INT_MIN)
+	sp[-1] = INT_VAL(-AS_INT(PEEK(0)));
+      else if (IS_DOUBLE(PEEK(0)))
+	PEEK(0) = NUMBER_VAL(-AS_DOUBLE(PEEK(0)));
+      else {
+	SAVE_STATE();
+	negate_number();
+      }
+      DISPATCH();
+    CASE(OP_GET_UPVALUE): {
       uint8_t slot = READ_BYTE();
-      push(*frame->closure->upvalues[slot]->location);
-      break;
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
     }
 
-    case OP_SET_UPVALUE: {
+    CASE(OP_SET_UPVALUE): {
       uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0);
-      break;
+      obj_upvalue *upvalue = frame->closure->upvalues[slot];
+      STORE_VAL(upvalue, *upvalue->location, PEEK(0));
+      DISPATCH();
     }
-    case OP_PRINT: {
-      print_val(pop());
-      break;
+    CASE(OP_GET_UPVALUE_LONG): {
+      uint16_t slot = READ_SHORT();
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
     }
-    case OP_POP:
-      pop();
-      break;
-    case OP_RETURN: {
+    CASE(OP_SET_UPVALUE_LONG): {
+      uint16_t slot = READ_SHORT();
+      obj_upvalue *upvalue = frame->closure->upvalues[slot];
+      STORE_VAL(upvalue, *upvalue->location, PEEK(0));
+      DISPATCH();
+    }
+    CASE(OP_PRINT): {
+      if (IS_ROPE(PEEK(0))) {
+	SAVE_STATE();
+	flatten_operand(0);
+      }
+      print_val(POP());
+      DISPATCH();
+    }
+    CASE(OP_POP):
+      sp--;
+      DISPATCH();
+      /* the superinstructions finish integer operands on the spot and
+       * hand anything else to the handler of the op they end with */
+    CASE(OP_ADD_LOCALS): {
+      Val a = slots[READ_BYTE()];
+      Val b = slots[READ_BYTE()];
+      FUSED_ADD(a, b);
+      DISPATCH();
+    }
+    CASE(OP_ADD_LOCAL_CONST): {
+      Val a = slots[READ_BYTE()];
+      Val b = READ_CONSTANT();
+      FUSED_ADD(a, b);
+      DISPATCH();
+    }
+    CASE(OP_LESS_LOCAL_CONST): {
+      Val a = slots[READ_BYTE()];
+      Val b = READ_CONSTANT();
+      if (!IS_INT(a) || !IS_INT(b)) {
+	PUSH(a);
+	PUSH(b);
+	goto op_less;
+      }
+      PUSH(BOOL_VAL(AS_INT(a) < AS_INT(b)));
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_POP): {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = POP();
+      DISPATCH();
+    }
+    CASE(OP_ADD_NUM):
+      if (!NUMBER_OPERANDS())
+	DEOPTIMIZE(OP_ADD, op_add);
+      ARITH_OP(__builtin_add_overflow, +, OP_ADD);
+      DISPATCH();
+    CASE(OP_ADD_STR):
+      if (!IS_TEXT(PEEK(0)) || !IS_TEXT(PEEK(1)))
+	DEOPTIMIZE(OP_ADD, op_add);
+      SAVE_STATE();
+      if (!concatenate())
+	RUNTIME_ERROR("String too long.");
+      sp = vm.stack_top;
+      DISPATCH();
+    CASE(OP_GREATER_NUM):
+      if (!NUMBER_OPERANDS())
+	DEOPTIMIZE(OP_GREATER, op_greater);
+      COMPARE_OP(>, OP_GREATER);
+      DISPATCH();
+    CASE(OP_LESS_NUM):
+      if (!NUMBER_OPERANDS())
+	DEOPTIMIZE(OP_LESS, op_less);
+      COMPARE_OP(<, OP_LESS);
+      DISPATCH();
+    CASE(OP_RETURN): {
       // simply exit, as print has been intro'd
-      Val result = pop();
-      close_upvalues(frame->slots);
+      Val result = POP();
+      close_upvalues(slots);
       vm.frame_count--;
       if (vm.frame_count == 0) {
-	pop();
+	sp--;
+	vm.stack_top = sp;
 	return INTERPRET_OK;
       }
-      vm.stack_top = frame->slots;
-      push(result);
+      sp = slots;
+      PUSH(result);
       frame = &vm.frame[vm.frame_count - 1];
-      break;
+      ip = frame->ip;
+      slots = frame->slots;
+      JIT_ENTER();
+      DISPATCH();
     }
+    default:
+#ifdef THREADED_DISPATCH
+    TARGET_UNKNOWN:
+#endif
+      RUNTIME_ERROR("unknown opcode %d.", ip[-1]);
     }
   }
+#undef SAVE_STATE
+#undef LOAD_STATE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef READ_SHORT
+#undef READ_CONSTANT_LONG
 #undef BIN_OP
+#undef ARITH_OP
+#undef COMPARE_OP
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef NUMBER_OPERANDS
+#undef FUSED_ADD
+#undef JIT_ENTER
+#undef CASE
+#undef DISPATCH
 }
 
-interpreted_result interpret(const char *source) {
-  /* return run(); */
-  obj_function *function = compile(source);
-  if (function == NULL) {
-    return INTERPRET_COMPILE_ERROR;
+#ifdef REGISTER_VM
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_REGISTERS()                                                      \
+  do {                                                                         \
+    printf("       ");                                                         \
+    for (Val *slot = r; slot < r + code->const_base; slot++) {                 \
+      printf("[ ");                                                            \
+      print_val(*slot);                                                        \
+      printf(" ]");                                                            \
+    }                                                                          \
+    printf("\n");                                                              \
+    disassemble_reg_instruction(code, (int)(pc - code->code));                 \
+  } while (false)
+#else
+#define TRACE_REGISTERS()
+#endif
+
+/* run a call of a function with register code to its return. the
+ * registers are the frame's slots, the callee and args included, and
+ * the frame is gone again once this returns true */
+static bool run_registers(call_frame *frame) {
+  reg_chunk *code = frame->closure->function->registers;
+  Val *r = frame->slots;
+  /* call() left REG_COUNT values and FRAME_SLACK free, two more than
+   * REG_COUNT at most go to the operands of a concatenation */
+  if (r + REG_COUNT(code) + 2 > vm.stack + vm.stack_capacity) {
+    /* no instruction of the callee has run, blame the call */
+    vm.frame_count--;
+    runtime_error("Stack overflow!");
+    return false;
+  }
+  for (Val *slot = r + frame->closure->function->arity + 1;
+       slot < r + code->const_base; slot++)
+    *slot = NIL_VAL;
+  memcpy(r + code->const_base, code->constants,
+	 sizeof(Val) * code->const_count);
+  /* the registers are roots while the code runs */
+  vm.stack_top = r + REG_COUNT(code);
+
+  reg_inst *pc = code->code;
+  /* the instruction being run is pc[-1] */
+#define INST (pc[-1])
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    frame->ip = frame->closure->function->chunk.code +                         \
+		code->origins[pc - 1 - code->code] + 1;                        \
+    runtime_error(__VA_ARGS__);                                                \
+    return false;                                                              \
+  } while (false)
+  /* the operands go on the stack for number_op(), which may box */
+#define NUMBER_OP(opcode)                                                      \
+  do {                                                                         \
+    push(r[INST.b]);                                                           \
+    push(r[INST.c]);                                                           \
+    number_op(opcode);                                                         \
+    r[INST.a] = pop();                                                         \
+  } while (false)
+#define ARITH_OP(overflows, op, opcode)                                        \
+  do {                                                                         \
+    Val b = r[INST.b];                                                         \
+    Val c = r[INST.c];                                                         \
+    int64_t result;                                                            \
+    if (IS_INT(b) && IS_INT(c) &&                                              \
+	!overflows(AS_INT(b), AS_INT(c), &result) && result >= VAL_INT_MIN &&  \
+	result <= VAL_INT_MAX)                                                 \
+      r[INST.a] = INT_VAL(result);                                             \
+    else if (!IS_NUMERIC(b) || !IS_NUMERIC(c))                                 \
+      RUNTIME_ERROR("operands must be numbers.");                              \
+    else if (IS_DOUBLE(b) || IS_DOUBLE(c))                                     \
+      r[INST.a] = NUMBER_VAL(as_numeric(b) op as_numeric(c));                  \
+    else                                                                       \
+      NUMBER_OP(opcode);                                                       \
+  } while (false)
+#define COMPARE_OP(op, opcode)                                                 \
+  do {                                                                         \
+    Val b = r[INST.b];                                                         \
+    Val c = r[INST.c];                                                         \
+    if (IS_INT(b) && IS_INT(c))                                                \
+      r[INST.a] = BOOL_VAL(AS_INT(b) op AS_INT(c));                            \
+    else if (!IS_NUMERIC(b) || !IS_NUMERIC(c))                                 \
+      RUNTIME_ERROR("operands must be numbers.");                              \
+    else if (IS_DOUBLE(b) || IS_DOUBLE(c))                                     \
+      r[INST.a] = BOOL_VAL(as_numeric(b) op as_numeric(c));                    \
+    else                                                                       \
+      NUMBER_OP(opcode);                                                       \
+  } while (false)
+
+#ifdef THREADED_DISPATCH
+  static void *dispatch_table[] = {
+      [REG_MOVE] = &&TARGET_REG_MOVE,
+      [REG_GET_GLOBAL] = &&TARGET_REG_GET_GLOBAL,
+      [REG_EQUAL] = &&TARGET_REG_EQUAL,
+      [REG_GREATER] = &&TARGET_REG_GREATER,
+      [REG_LESS] = &&TARGET_REG_LESS,
+      [REG_ADD] = &&TARGET_REG_ADD,
+      [REG_SUBTRACT] = &&TARGET_REG_SUBTRACT,
+      [REG_MULTIPLY] = &&TARGET_REG_MULTIPLY,
+      [REG_DIVIDE] = &&TARGET_REG_DIVIDE,
+      [REG_NOT] = &&TARGET_REG_NOT,
+      [REG_NEGATE] = &&TARGET_REG_NEGATE,
+      [REG_PRINT] = &&TARGET_REG_PRINT,
+      [REG_JUMP] = &&TARGET_REG_JUMP,
+      [REG_JUMP_IF_FALSE] = &&TARGET_REG_JUMP_IF_FALSE,
+      [REG_RETURN] = &&TARGET_REG_RETURN,
+  };
+#define CASE(op) case op: TARGET_##op
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_REGISTERS();                                                         \
+    goto *dispatch_table[(pc++)->op];                                          \
+  } while (false)
+#else
+#define CASE(op) case op
+#define DISPATCH() break
+#endif
+
+  for (;;) {
+    TRACE_REGISTERS();
+    switch ((pc++)->op) {
+    CASE(REG_MOVE):
+      r[INST.a] = r[INST.b];
+      DISPATCH();
+    CASE(REG_GET_GLOBAL): {
+      int slot = REG_BC(INST);
+      r[INST.a] = vm.global_values.values[slot];
+      if (IS_UNDEFINED(r[INST.a]))
+	RUNTIME_ERROR("undefined variable '%s in get_glob'.",
+		      AS_CSTRING(vm.global_names.values[slot]));
+      DISPATCH();
+    }
+    CASE(REG_EQUAL): {
+      Val b = r[INST.b];
+      Val c = r[INST.c];
+      if (IS_ROPE(b) || IS_ROPE(c)) {
+	push(b);
+	push(c);
+	flatten_operand(0);
+	flatten_operand(1);
+	c = pop();
+	b = pop();
+      }
+      r[INST.a] = BOOL_VAL(is_equal(b, c));
+      DISPATCH();
+    }
+    CASE(REG_GREATER):
+      COMPARE_OP(>, OP_GREATER);
+      DISPATCH();
+    CASE(REG_LESS):
+      COMPARE_OP(<, OP_LESS);
+      DISPATCH();
+    CASE(REG_ADD):
+      if (IS_TEXT(r[INST.b]) && IS_TEXT(r[INST.c])) {
+	push(r[INST.b]);
+	push(r[INST.c]);
+	if (!concatenate()) {
+	  vm.stack_top -= 2;
+	  RUNTIME_ERROR("String too long.");
+	}
+	r[INST.a] = pop();
+      } else if (IS_NUMERIC(r[INST.b]) && IS_NUMERIC(r[INST.c])) {
+	ARITH_OP(__builtin_add_overflow, +, OP_ADD);
+      } else {
+	RUNTIME_ERROR("Operands to '+' must be two numbers or two strings");
+      }
+      DISPATCH();
+    CASE(REG_SUBTRACT):
+      ARITH_OP(__builtin_sub_overflow, -, OP_SUBTRACT);
+      DISPATCH();
+    CASE(REG_MULTIPLY):
+      ARITH_OP(__builtin_mul_overflow, *, OP_MULTIPLY);
+      DISPATCH();
+    CASE(REG_DIVIDE): {
+      /* exact integer division only, as on the stack */
+      Val b = r[INST.b];
+      Val c = r[INST.c];
+      if (IS_INT(b) && IS_INT(c) && AS_INT(c) != 0 && AS_INT(c) != -1 &&
+	  AS_INT(b) % AS_INT(c) == 0)
+	r[INST.a] = INT_VAL(AS_INT(b) / AS_INT(c));
+      else if (!IS_NUMERIC(b) || !IS_NUMERIC(c))
+	RUNTIME_ERROR("operands must be numbers.");
+      else if (IS_DOUBLE(b) || IS_DOUBLE(c))
+	r[INST.a] = NUMBER_VAL(as_numeric(b) / as_numeric(c));
+      else
+	NUMBER_OP(OP_DIVIDE);
+      DISPATCH();
+    }
+    CASE(REG_NOT):
+      r[INST.a] = BOOL_VAL(is_false(r[INST.b]));
+      DISPATCH();
+    CASE(REG_NEGATE): {
+      Val b = r[INST.b];
+      if (!IS_NUMERIC(b))
+	RUNTIME_ERROR("Operand must be a number.");
+      if (IS_INT(b) && AS_INT(b) != VAL_INT_MIN)
+	r[INST.a] = INT_VAL(-AS_INT(b));
+      else if (IS_DOUBLE(b))
+	r[INST.a] = NUMBER_VAL(-AS_DOUBLE(b));
+      else {
+	push(b);
+	negate_number();
+	r[INST.a] = pop();
+      }
+      DISPATCH();
+    }
+    CASE(REG_PRINT): {
+      push(r[INST.a]);
+      flatten_operand(0);
+      print_val(pop());
+      DISPATCH();
+    }
+    CASE(REG_JUMP):
+      pc = code->code + REG_BC(INST);
+      DISPATCH();
+    CASE(REG_JUMP_IF_FALSE):
+      if (is_false(r[INST.a]))
+	pc = code->code + REG_BC(INST);
+      DISPATCH();
+    CASE(REG_RETURN): {
+      Val result = r[INST.a];
+      vm.frame_count--;
+      vm.stack_top = r;
+      push(result);
+      return true;
+    }
+    }
   }
+#undef INST
+#undef RUNTIME_ERROR
+#undef NUMBER_OP
+#undef ARITH_OP
+#undef COMPARE_OP
+#undef CASE
+#undef DISPATCH
+}
+#endif
+
+Val *jit_slow_path(Val *sp, call_frame *frame, uint8_t *ip, uint8_t op) {
+  /* anything below may allocate, the collector sees the whole stack
+   * and an out of memory error the right line */
+  vm.stack_top = sp;
+  frame->ip = ip + 1;
+  switch (op) {
+  case OP_ADD:
+    if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) {
+      /* too long, run() reports it */
+      if (!concatenate())
+	return NULL;
+      return vm.stack_top;
+    }
+    /* fall through */
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_LESS:
+  case OP_GREATER:
+    if (!IS_NUMERIC(peek(0)) || !IS_NUMERIC(peek(1)))
+      return NULL;
+    number_op(op);
+    return vm.stack_top;
+  case OP_EQUAL: {
+    flatten_operand(0);
+    flatten_operand(1);
+    Val b = pop();
+    Val a = pop();
+    push(BOOL_VAL(is_equal(a, b)));
+    return vm.stack_top;
+  }
+  case OP_NOT:
+    sp[-1] = BOOL_VAL(is_false(sp[-1]));
+    return sp;
+  case OP_NEGATE:
+    if (!IS_NUMERIC(sp[-1]))
+      return NULL;
+    negate_number();
+    return sp;
+  case OP_PRINT:
+    flatten_operand(0);
+    print_val(pop());
+    return vm.stack_top;
+  case OP_DEF_GLOBAL:
+  case OP_SET_GLOBAL: {
+    int slot = (ip[1] << 8) | ip[2];
+    if (op == OP_SET_GLOBAL && IS_UNDEFINED(vm.global_values.values[slot]))
+      return NULL;
+    vm.global_values.values[slot] = sp[-1];
+    root_write_barrier(sp[-1]);
+    return op == OP_DEF_GLOBAL ? sp - 1 : sp;
+  }
+  case OP_SET_UPVALUE:
+  case OP_SET_UPVALUE_LONG: {
+    int slot = op == OP_SET_UPVALUE ? ip[1] : (ip[1] << 8) | ip[2];
+    obj_upvalue *upvalue = frame->closure->upvalues[slot];
+    STORE_VAL(upvalue, *upvalue->location, sp[-1]);
+    return sp;
+  }
+  case OP_CLOSE_UPVALUE:
+    close_upvalues(sp - 1);
+    return sp - 1;
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    bool wide = op == OP_CLOSURE_LONG;
+    int constant = wide ? (ip[1] << 16) | (ip[2] << 8) | ip[3] : ip[1];
+    obj_function *function =
+	AS_FUNCTION(frame->closure->function->chunk.constants.values[constant]);
+    obj_closure *closure = new_closure(function);
+    push(OBJ_VAL(closure));
+    capture_upvalues(closure, frame, ip + (wide ? 4 : 2), wide);
+    return vm.stack_top;
+  }
+  }
+  return NULL;
+}
+
+static interpreted_result run_function(obj_function *function) {
   push(OBJ_VAL(function));
   obj_closure *closure = new_closure(function);
   pop();
@@ -431,7 +1475,47 @@ interpreted_result interpret(const char *source) {
   /* frame->slots = vm.stack; */
 
   /* top level function call */
-  call(closure, 0);
+  if (!call(closure, 0))
+    return INTERPRET_RUNTIME_ERROR;
 
   return run();
 }
+
+static interpreted_result interpret_source(const char *source) {
+  /* return run(); */
+  obj_function *function = compile(source);
+  if (function == NULL) {
+    return INTERPRET_COMPILE_ERROR;
+  }
+  return run_function(function);
+}
+
+interpreted_result interpret(const char *source) {
+  /* an allocation the heap can't satisfy, even after a full collection,
+   * lands here. nothing that has been allocated is lost, the script
+   * just stops */
+  jmp_buf handler;
+  if (setjmp(handler)) {
+    vm.oom_handler = NULL;
+    abort_compile();
+    runtime_error("out of memory.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  vm.oom_handler = &handler;
+  interpreted_result result = interpret_source(source);
+  vm.oom_handler = NULL;
+  return result;
+}
+
+interpreted_result interpret_function(obj_function *function) {
+  jmp_buf handler;
+  if (setjmp(handler)) {
+    vm.oom_handler = NULL;
+    runtime_error("out of memory.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  vm.oom_handler = &handler;
+  interpreted_result result = run_function(function);
+  vm.oom_handler = NULL;
+  return result;
+}
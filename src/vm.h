@@ -1,30 +1,111 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <setjmp.h>
+
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
 #include "object.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)   //Are 8 bytes enough?
+/* both stacks start small and grow as calls nest deeper, up to these
+ * default limits on the call depth and on the bytes of the value stack */
+#define FRAMES_MAX (1 << 16)
+#define STACK_MAX ((size_t)64 << 20)
+#define FRAMES_INIT 16
+/* values the stack starts with room for */
+#define STACK_INIT (2 * UINT8_COUNT)
+/* values a call keeps free above the most its function holds at once,
+ * for the ones an op pushes to keep its operands reachable while it
+ * allocates */
+#define FRAME_SLACK 8
+/* counters of back edges taken, loops share them by their header's address */
+#define HOT_LOOPS 64
+/* bucket i of the pause histogram counts pauses shorter than 2^i microseconds */
+#define GC_PAUSE_BUCKETS 24
 
-typedef struct {
+/* where an incremental full collection currently is */
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_WEAK,    //marking is done, the intern table is being cleared
+    GC_SWEEP
+} gc_phase;
+
+typedef struct call_frame {
     obj_closure *closure;
     uint8_t *ip;
     Val *slots;
 } call_frame;
 
 typedef struct {
-    call_frame frame[FRAMES_MAX];
+    call_frame *frame;
     int frame_count;
-    Val stack[STACK_MAX]; //My stack based proglang!
+    int frame_capacity;
+    /* frame slots and open upvalues point into the stack, they are
+     * moved along when it is reallocated */
+    Val *stack; //My stack based proglang!
     Val *stack_top;
+    int stack_capacity;
+    /* limits on the call depth and the bytes of the value stack.
+     * embedders may set them any time after init_vm() */
+    int max_frames;
+    size_t max_stack;
+    /* calls before a function is compiled to machine code, 0 never */
+    uint32_t jit_threshold;
+    /* back edges a loop takes before it is traced, 0 never */
+    uint32_t trace_threshold;
+    uint32_t loop_hits[HOT_LOOPS];
     table strings; //String interning
     obj_upvalue *open_upvalue;
-    table globals;
-    /* point to the head of the object heap */
+    /* the compiler resolves every global name to a slot. global_slots
+     * maps names to slot numbers, global_names and global_values are
+     * indexed by slot. a slot holds UNDEFINED_VAL until its variable
+     * is defined */
+    table global_slots;
+    val_array global_names;
+    val_array global_values;
+    /* point to the head of the object heap (the old generation) */
     Obj *objects;
+    /* the nursery, every new object starts out here */
+    Obj *young_objects;
+    size_t young_bytes;
+    /* old objects that may point into the nursery, plus nursery objects
+     * stored into the root tables. minor collections trace from here
+     * instead of walking the whole old generation */
+    int remembered_count;
+    int remembered_capacity;
+    Obj **remembered;
+    /* strings interned since the last minor collection, the only intern
+     * table entries a minor collection may have to drop */
+    int young_string_count;
+    int young_string_capacity;
+    obj_string **young_strings;
+    /* heap accounting, the collector runs once bytes_allocated passes next_gc */
+    size_t bytes_allocated;
+    size_t next_gc;
+    /* hard limit on bytes_allocated, 0 for none. embedders may set it
+     * any time after init_vm() */
+    size_t max_heap;
+    /* where an allocation that can't be satisfied unwinds to, set
+     * while interpret() runs */
+    jmp_buf *oom_handler;
+    /* worklist of marked objects whose references are yet to be traced */
+    int gray_count;
+    int gray_capacity;
+    Obj **gray_stack;
+    /* incremental mode splits full collections into steps of at most
+     * gc_step_budget objects, interleaved with allocation */
+    bool gc_incremental;
+    /* incremental mode with the marking done by a helper thread */
+    bool gc_concurrent;
+    int gc_step_budget;
+    gc_phase gc_state;
+    size_t gc_step_debt;
+    /* every collector pause, minor, full or incremental step */
+    size_t gc_pauses[GC_PAUSE_BUCKETS];
+    uint64_t gc_max_pause_ns;
+    uint64_t gc_total_pause_ns;
 } VM;
 
 typedef enum {
@@ -39,7 +120,10 @@ extern VM vm;
 void init_vm();
 void free_vm();
 interpreted_result interpret(const char *source);
+/* run an already compiled script */
+interpreted_result interpret_function(obj_function *function);
 void push(Val value);
 Val pop();
+int global_slot(obj_string *name);
 
 #endif
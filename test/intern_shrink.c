@@ -0,0 +1,51 @@
+/* the intern table gives its memory back in the incremental modes too,
+ * not only when a stop-the-world collection purges it. run by
+ * test/run.sh against libcpplox.a */
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+
+/* keeps 2^14 distinct strings alive at once and drops them. the lists
+ * built after that outlive the nursery, so the old generation keeps
+ * growing until full collection cycles have run to the end */
+static const char *script =
+    "fn cons(head, tail) {\n"
+    "  fn pick(first) { if (first) return head; return tail; }\n"
+    "  return pick;\n"
+    "}\n"
+    "let list = nil;\n"
+    "fn gen(prefix, k) {\n"
+    "  if (k == 0) { list = cons(prefix, list); return; }\n"
+    "  gen(prefix + \"0\", k - 1);\n"
+    "  gen(prefix + \"1\", k - 1);\n"
+    "}\n"
+    "gen(\"\", 14);\n"
+    "list = nil;\n"
+    "let round = 0;\n"
+    "while (round < 100) {\n"
+    "  let junk = nil;\n"
+    "  let i = 0;\n"
+    "  while (i < 5000) { junk = cons(i, junk); i = i + 1; }\n"
+    "  round = round + 1;\n"
+    "}\n";
+
+static int run(bool concurrent) {
+    init_vm();
+    vm.gc_incremental = true;
+    vm.gc_concurrent = concurrent;
+    int failed = 0;
+    if(interpret(script) != INTERPRET_OK) {
+        failed = 1;
+    } else if(vm.strings.capacity > 1024) {
+        fprintf(stderr, "%s: intern table still has %d slots\n",
+                concurrent ? "concurrent" : "incremental", vm.strings.capacity);
+        failed = 1;
+    }
+    free_vm();
+    return failed;
+}
+
+int main() {
+    return run(false) | run(true);
+}
@@ -0,0 +1,30 @@
+#!/bin/bash
+# usage: test/run.sh binary [library]
+# runs every test/*.lox and compares what it prints, stderr included,
+# with test/<name>.expected. with the library built by make lib, also
+# builds every test/*.c against it and runs it, 0 being a pass
+bin="$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"
+lib=
+[ -n "$2" ] && lib="$(cd "$(dirname "$2")" && pwd)/$(basename "$2")"
+cd "$(dirname "$0")"
+failed=0
+for script in *.lox; do
+  if "$bin" "$script" 2>&1 | cmp -s - "${script%.lox}.expected"; then
+    echo "ok      ${script%.lox}"
+  else
+    echo "FAILED  ${script%.lox}"
+    failed=1
+  fi
+done
+[ -z "$lib" ] && exit $failed
+for test in *.c; do
+  # the same flags as the library, see make lib
+  if ${CC:-gcc} ${CFLAGS:--g -Wall -pthread} -I../src -o "${test%.c}.out" "$test" "$lib" -lm &&
+      "./${test%.c}.out"; then
+    echo "ok      ${test%.c}"
+  else
+    echo "FAILED  ${test%.c}"
+    failed=1
+  fi
+done
+exit $failed